@@ -1,22 +1,46 @@
+#define _POSIX_C_SOURCE 200809L
+#ifdef __linux__
+#define _DEFAULT_SOURCE
+#endif
+
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
 #include <memory.h>
 #include <stdio.h>
 
+#if defined(__unix__) || defined(__APPLE__)
+#define JSON_MMAP
+#define JSON_THREADS
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#if defined(__linux__) && !defined(JSON_NO_IO_URING)
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define JSON_IO_URING
+#include <errno.h>
+#include <sched.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#endif
+#endif
+
 #include "json.h"
 
-#define advance(context, token_type) \
-    do{\
-    if(context->curtok.type != token_type) { \
-        fprintf(stderr, "Expected token %s got %s at %c\n",\
-                tok2str[token_type],\
-                tok2str[context->curtok.type],\
-                context->text[context->pos]);\
-        exit(1);\
-    }\
-    context->curtok=next_token(context);\
-    }while(0)
+#if defined(__SSE2__) && !defined(JSON_NO_SIMD)
+#define JSON_SSE2
+#include <emmintrin.h>
+// The UTF-8 block validator needs pshufb, picked at runtime
+#if defined(__GNUC__) || defined(__clang__)
+#define JSON_SSSE3
+#include <tmmintrin.h>
+#endif
+#endif
 
 const char *tok2str[] = {
     "TOKEN_STRING",
@@ -30,6 +54,7 @@ const char *tok2str[] = {
     "TOKEN_OBJECT_END",
     "TOKEN_COMMA",
     "TOKEN_COLUMN",
+    "TOKEN_NONE",
 };
 
 typedef struct {
@@ -37,6 +62,11 @@ typedef struct {
     u32 len;
     char *text;
     __json_token_t curtok;
+    u32 tokstart;
+    u32 prev_end;
+    u32 err;
+    // Where the value being parsed records its span, NULL outside documents
+    __json_span_t *span;
 } json_context_t;
 
 u32 parse_array(json_context_t *context, json_value_t *value);
@@ -44,6 +74,21 @@ u32 parse_object(json_context_t *context, json_value_t *value);
 u32 parse_string(const json_context_t *context, __json_token_t *token);
 u32 parse_value(json_context_t *context, json_value_t *value);
 u32 parse_property(json_context_t *context, json_property_t *prop);
+static __json_token_t next_token(json_context_t *context);
+
+/*
+ * Consumes the current token, JSON_PARSE_ERR when it isn't token_type
+ * or when the token after it is malformed.
+ */
+static inline
+u32 advance(json_context_t *context, const __json_token_type_t token_type) {
+    if (context->curtok.type != token_type) {
+        return JSON_PARSE_ERR;
+    }
+    context->prev_end = context->pos;
+    context->curtok = next_token(context);
+    return context->err;
+}
 
 static inline
 u32 skip_spaces(const json_context_t *context) {
@@ -51,14 +96,51 @@ u32 skip_spaces(const json_context_t *context) {
     const char *text = context->text;
     while (text[pos] == ' '
             || text[pos] == '\n'
-            || text[pos] == '\t')
+            || text[pos] == '\t'
+            || text[pos] == '\r')
+        pos++;
+    return pos;
+}
+
+static inline
+BOOL is_whitespace(const char c) {
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r';
+}
+
+static inline
+u32 skip_whitespace(const char *text, u32 pos, const u32 len) {
+    if (pos < len && !is_whitespace(text[pos])) {
+        return pos;
+    }
+#ifdef JSON_SSE2
+    while (pos + 16 <= len) {
+        const __m128i chunk = _mm_loadu_si128((const __m128i *)&(text[pos]));
+        const __m128i ws = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(' ')),
+                    _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\n'))),
+                _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('\t')),
+                    _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\r'))));
+        const u32 mask = ~(u32)_mm_movemask_epi8(ws) & 0xFFFF;
+        if (mask) {
+            return pos + __builtin_ctz(mask);
+        }
+        pos += 16;
+    }
+#endif
+    while (pos < len && is_whitespace(text[pos]))
         pos++;
     return pos;
 }
 
+static inline
+u8 is_digit(const char token) {
+    return token <= '9' && token >= '0';
+}
+
+// Can start a number, signs only count in front
 static inline
 u8 is_number(const char token) {
-    return (token <= '9' && token >= '0') || token == '-';
+    return is_digit(token) || token == '-';
 }
 
 static inline
@@ -71,8 +153,12 @@ u32 parse_number(const json_context_t *context, __json_token_t *token) {
     if (neg) {
         pos++;
     }
+    // A lone sign leaves the token unset
+    if (!is_digit(text[pos])) {
+        return context->pos;
+    }
 
-    while (is_number(text[pos])) {
+    while (is_digit(text[pos])) {
         value *= 10;
         value += text[pos] - '0';
         pos++;
@@ -83,7 +169,7 @@ u32 parse_number(const json_context_t *context, __json_token_t *token) {
         pos++;
         double decimal_factor = 1.0;
 
-        while (is_number(text[pos])) {
+        while (is_digit(text[pos])) {
             decimal *= 10.0;
             decimal += text[pos] - '0';
             decimal_factor *= 10.0;
@@ -101,63 +187,453 @@ u32 parse_number(const json_context_t *context, __json_token_t *token) {
     return pos;
 }
 
+/*
+ * Literals leave the token unset and the position unchanged when the
+ * text doesn't spell them out.
+ */
 static inline
 u32 parse_null(const json_context_t *context, __json_token_t *token) {
-    u32 pos = context->pos;
-    const char *text = context->text;
-    assert(text[pos++] == 'n');
-    assert(text[pos++] == 'u');
-    assert(text[pos++] == 'l');
-    assert(text[pos++] == 'l');
+    const u32 pos = context->pos;
+    if (strncmp(&(context->text[pos]), "null", 4)) {
+        return pos;
+    }
     token->type = TOKEN_NULL;
-    return pos;
+    return pos + 4;
 }
 
 static inline
 u32 parse_false(const json_context_t *context, __json_token_t *token) {
-    u32 pos = context->pos;
-    const char *text = context->text;
-    assert(text[pos++] == 'f');
-    assert(text[pos++] == 'a');
-    assert(text[pos++] == 'l');
-    assert(text[pos++] == 's');
-    assert(text[pos++] == 'e');
+    const u32 pos = context->pos;
+    if (strncmp(&(context->text[pos]), "false", 5)) {
+        return pos;
+    }
     token->boolean = FALSE;
     token->type = TOKEN_FALSE;
-    return pos;
+    return pos + 5;
 }
 
 static inline
 u32 parse_true(const json_context_t *context, __json_token_t *token) {
-    u32 pos = context->pos;
-    const char *text = context->text;
-    assert(text[pos++] == 't');
-    assert(text[pos++] == 'r');
-    assert(text[pos++] == 'u');
-    assert(text[pos++] == 'e');
+    const u32 pos = context->pos;
+    if (strncmp(&(context->text[pos]), "true", 4)) {
+        return pos;
+    }
     token->boolean = TRUE;
     token->type = TOKEN_TRUE;
+    return pos + 4;
+}
+
+/*
+ * Returns the position of the first '"' or '\\' in text[pos..len),
+ * or a value >= len when there is none.
+ */
+static inline
+u32 find_quote_or_escape(const char *text, u32 pos, const u32 len) {
+#ifdef JSON_SSE2
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i escape = _mm_set1_epi8('\\');
+    while (pos + 16 <= len) {
+        const __m128i chunk = _mm_loadu_si128((const __m128i *)&(text[pos]));
+        const u32 mask = (u32)_mm_movemask_epi8(_mm_or_si128(
+                    _mm_cmpeq_epi8(chunk, quote),
+                    _mm_cmpeq_epi8(chunk, escape)));
+        if (mask) {
+            return pos + __builtin_ctz(mask);
+        }
+        pos += 16;
+    }
+#endif
+    while (pos < len && text[pos] != '"' && text[pos] != '\\')
+        pos++;
+    return pos;
+}
+
+/*
+ * Like find_quote_or_escape but also stops at raw control characters
+ * (below 0x20), which are never allowed inside strings.
+ */
+static inline
+u32 find_string_special(const char *text, u32 pos, const u32 len) {
+#ifdef JSON_SSE2
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i escape = _mm_set1_epi8('\\');
+    const __m128i control = _mm_set1_epi8(0x1F);
+    const __m128i zero = _mm_setzero_si128();
+    while (pos + 16 <= len) {
+        const __m128i chunk = _mm_loadu_si128((const __m128i *)&(text[pos]));
+        // Saturating subtraction leaves 0 exactly for bytes <= 0x1F
+        const __m128i special = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+                    _mm_cmpeq_epi8(chunk, escape)),
+                _mm_cmpeq_epi8(_mm_subs_epu8(chunk, control), zero));
+        const u32 mask = (u32)_mm_movemask_epi8(special);
+        if (mask) {
+            return pos + __builtin_ctz(mask);
+        }
+        pos += 16;
+    }
+#endif
+    while (pos < len && text[pos] != '"' && text[pos] != '\\'
+            && (u8)text[pos] >= 0x20)
+        pos++;
     return pos;
 }
 
+/*
+ * Length of the well-formed UTF-8 sequence starting at s, 0 if the
+ * sequence is malformed, overlong, a surrogate or past U+10FFFF.
+ */
+static inline
+u32 utf8_sequence_len(const u8 *s, const u32 left) {
+    const u8 c = s[0];
+    if (c < 0x80) return 1;
+
+    u8 lo = 0x80, hi = 0xBF;
+    u32 n;
+    if (c >= 0xC2 && c <= 0xDF) {
+        n = 2;
+    } else if (c >= 0xE0 && c <= 0xEF) {
+        n = 3;
+        if (c == 0xE0) lo = 0xA0;
+        if (c == 0xED) hi = 0x9F;
+    } else if (c >= 0xF0 && c <= 0xF4) {
+        n = 4;
+        if (c == 0xF0) lo = 0x90;
+        if (c == 0xF4) hi = 0x8F;
+    } else {
+        return 0;
+    }
+
+    if (left < n) return 0;
+    if (s[1] < lo || s[1] > hi) return 0;
+    for (u32 i=2; i<n; i++) {
+        if ((s[i] & 0xC0) != 0x80) return 0;
+    }
+    return n;
+}
+
+#ifdef JSON_SSSE3
+#define UTF8_TOO_SHORT      ((char)(1 << 0))
+#define UTF8_TOO_LONG       ((char)(1 << 1))
+#define UTF8_OVERLONG_3     ((char)(1 << 2))
+#define UTF8_TOO_LARGE      ((char)(1 << 3))
+#define UTF8_SURROGATE      ((char)(1 << 4))
+#define UTF8_OVERLONG_2     ((char)(1 << 5))
+#define UTF8_TOO_LARGE_1000 ((char)(1 << 6))
+#define UTF8_OVERLONG_4     ((char)(1 << 6))
+#define UTF8_TWO_CONTS      ((char)(1 << 7))
+#define UTF8_CARRY (UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS)
+
+__attribute__((target("ssse3")))
+static inline
+__m128i utf8_high_nibbles(const __m128i v) {
+    return _mm_and_si128(_mm_srli_epi16(v, 4), _mm_set1_epi8(0x0F));
+}
+
+/*
+ * Error bits of a 16 byte block given the block before it, from
+ * Keiser & Lemire "Validating UTF-8 In Less Than One Instruction Per
+ * Byte": three nibble lookups classify every pair of adjacent bytes,
+ * the 3rd and 4th bytes of long sequences are checked apart.
+ */
+__attribute__((target("ssse3")))
+static inline
+__m128i utf8_block_errors(const __m128i input, const __m128i prev_input) {
+    const __m128i byte_1_high_table = _mm_setr_epi8(
+            UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+            UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+            UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS,
+            UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+            UTF8_TOO_SHORT,
+            UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+            UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000
+                | UTF8_OVERLONG_4);
+    const __m128i byte_1_low_table = _mm_setr_epi8(
+            UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4,
+            UTF8_CARRY | UTF8_OVERLONG_2,
+            UTF8_CARRY,
+            UTF8_CARRY,
+            UTF8_CARRY | UTF8_TOO_LARGE,
+            UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+            UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+            UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+            UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+            UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+            UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+            UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+            UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+            UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000
+                | UTF8_SURROGATE,
+            UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+            UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000);
+    const __m128i byte_2_high_table = _mm_setr_epi8(
+            UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+            UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+            UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS
+                | UTF8_OVERLONG_3 | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+            UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS
+                | UTF8_OVERLONG_3 | UTF8_TOO_LARGE,
+            UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS
+                | UTF8_SURROGATE | UTF8_TOO_LARGE,
+            UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS
+                | UTF8_SURROGATE | UTF8_TOO_LARGE,
+            UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT);
+
+    const __m128i prev1 = _mm_alignr_epi8(input, prev_input, 15);
+    const __m128i special = _mm_and_si128(
+            _mm_and_si128(
+                _mm_shuffle_epi8(byte_1_high_table, utf8_high_nibbles(prev1)),
+                _mm_shuffle_epi8(byte_1_low_table,
+                    _mm_and_si128(prev1, _mm_set1_epi8(0x0F)))),
+            _mm_shuffle_epi8(byte_2_high_table, utf8_high_nibbles(input)));
+
+    // Two continuations in a row are only fine as 3rd or 4th bytes
+    const __m128i prev2 = _mm_alignr_epi8(input, prev_input, 14);
+    const __m128i prev3 = _mm_alignr_epi8(input, prev_input, 13);
+    const __m128i must23 = _mm_or_si128(
+            _mm_subs_epu8(prev2, _mm_set1_epi8((char)(0xE0 - 0x80))),
+            _mm_subs_epu8(prev3, _mm_set1_epi8((char)(0xF0 - 0x80))));
+    const __m128i must23_80 = _mm_and_si128(must23,
+            _mm_set1_epi8((char)0x80));
+    return _mm_xor_si128(must23_80, special);
+}
+
+__attribute__((target("ssse3")))
+static
+BOOL utf8_validate_ssse3(const u8 *s, const u32 len) {
+    // Non-zero where the last bytes start a sequence the block cuts off
+    const __m128i incomplete_max = _mm_setr_epi8(
+            -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+            (char)(0xF0 - 1), (char)(0xE0 - 1), (char)(0xC0 - 1));
+    __m128i prev_input = _mm_setzero_si128();
+    __m128i prev_incomplete = _mm_setzero_si128();
+    __m128i error = _mm_setzero_si128();
+
+    u32 pos = 0;
+    for (; pos + 16 <= len; pos += 16) {
+        const __m128i input = _mm_loadu_si128((const __m128i *)&(s[pos]));
+        if (_mm_movemask_epi8(input) == 0) {
+            // ASCII only, valid unless the previous block was cut off
+            error = _mm_or_si128(error, prev_incomplete);
+        } else {
+            error = _mm_or_si128(error, utf8_block_errors(input, prev_input));
+            prev_incomplete = _mm_subs_epu8(input, incomplete_max);
+        }
+        prev_input = input;
+        if (pos % 256 == 0 && _mm_movemask_epi8(_mm_cmpeq_epi8(error,
+                        _mm_setzero_si128())) != 0xFFFF) {
+            return FALSE;
+        }
+    }
+
+    // The zero padding of the tail ends any sequence left open
+    u8 tail[16] = {0};
+    memcpy(tail, &(s[pos]), len - pos);
+    const __m128i input = _mm_loadu_si128((const __m128i *)tail);
+    error = _mm_or_si128(error, utf8_block_errors(input, prev_input));
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(error,
+                _mm_setzero_si128())) == 0xFFFF;
+}
+
+static inline
+BOOL cpu_has_ssse3(void) {
+#ifdef __SSSE3__
+    return TRUE;
+#else
+    return __builtin_cpu_supports("ssse3");
+#endif
+}
+#endif
+
+BOOL json_utf8_validate(const char *text, const u32 len) {
+    const u8 *s = (const u8 *)text;
+    u32 pos = 0;
+
+#ifdef JSON_SSSE3
+    if (len >= 16 && cpu_has_ssse3()) {
+        return utf8_validate_ssse3(s, len);
+    }
+#endif
+
+    while (pos < len) {
+#ifdef JSON_SSE2
+        // Skip whole ASCII blocks, the high bit of every byte is clear
+        while (pos + 16 <= len) {
+            const __m128i chunk = _mm_loadu_si128((const __m128i *)&(s[pos]));
+            const u32 mask = (u32)_mm_movemask_epi8(chunk);
+            if (mask) {
+                pos += __builtin_ctz(mask);
+                break;
+            }
+            pos += 16;
+        }
+        if (pos >= len) break;
+#endif
+        const u32 n = utf8_sequence_len(&(s[pos]), len - pos);
+        if (n == 0) return FALSE;
+        pos += n;
+    }
+
+    return TRUE;
+}
+
+static inline
+i32 hex_value(const char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static inline
+BOOL parse_hex4(const char *text, const u32 pos, u32 *codepoint) {
+    u32 cp = 0;
+    for (u32 i=0; i<4; i++) {
+        const i32 digit = hex_value(text[pos + i]);
+        if (digit < 0) return FALSE;
+        cp = (cp << 4) | (u32)digit;
+    }
+    *codepoint = cp;
+    return TRUE;
+}
+
+static inline
+u32 utf8_encode(char *out, const u32 cp) {
+    if (cp < 0x80) {
+        out[0] = (char)cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        out[0] = (char)(0xC0 | (cp >> 6));
+        out[1] = (char)(0x80 | (cp & 0x3F));
+        return 2;
+    }
+    if (cp < 0x10000) {
+        out[0] = (char)(0xE0 | (cp >> 12));
+        out[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        out[2] = (char)(0x80 | (cp & 0x3F));
+        return 3;
+    }
+    out[0] = (char)(0xF0 | (cp >> 18));
+    out[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+    out[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+    out[3] = (char)(0x80 | (cp & 0x3F));
+    return 4;
+}
+
+/*
+ * Decodes the escape sequence at text[pos] (pointing at the backslash)
+ * into out[*out_len..], returns the position right after the sequence
+ * or 0 when the sequence is invalid.
+ */
+static
+u32 decode_escape(const json_context_t *context, u32 pos,
+        char *out, u32 *out_len) {
+    const char *text = context->text;
+    const char c = text[pos + 1];
+    char decoded;
+
+    switch (c) {
+    case '"':  decoded = '"';  break;
+    case '\\': decoded = '\\'; break;
+    case '/':  decoded = '/';  break;
+    case 'b':  decoded = '\b'; break;
+    case 'f':  decoded = '\f'; break;
+    case 'n':  decoded = '\n'; break;
+    case 'r':  decoded = '\r'; break;
+    case 't':  decoded = '\t'; break;
+    case 'u': {
+        u32 cp;
+        if (!parse_hex4(text, pos + 2, &cp)) {
+            return 0;
+        }
+        pos += 6;
+
+        if (cp >= 0xD800 && cp <= 0xDBFF) {
+            u32 low;
+            if (text[pos] != '\\' || text[pos + 1] != 'u'
+                    || !parse_hex4(text, pos + 2, &low)
+                    || low < 0xDC00 || low > 0xDFFF) {
+                // Unpaired high surrogate
+                return 0;
+            }
+            cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+            pos += 6;
+        } else if (cp >= 0xDC00 && cp <= 0xDFFF) {
+            // Unpaired low surrogate
+            return 0;
+        }
+
+        *out_len += utf8_encode(&(out[*out_len]), cp);
+        return pos;
+    }
+    default:
+        return 0;
+    }
+
+    out[(*out_len)++] = decoded;
+    return pos + 2;
+}
+
+/*
+ * Leaves the token unset and returns the starting position when the
+ * string is unterminated, has a bad escape, a raw control character or
+ * malformed UTF-8.
+ */
 u32 parse_string(const json_context_t *context, __json_token_t *token) {
-    u32 pos = context->pos;
     const char *text = context->text;
+    const u32 len = context->len;
+    u32 pos = context->pos;
     assert(text[pos] == '"');
     pos++;
 
-    while (text[pos] != '"') {
-        if (text[pos] == '\\') {
-            pos++;
-        }
-        pos++;
+    const u32 starting_pos = pos;
+    const u32 first_escape = find_string_special(text, pos, len);
+
+    // Find the closing quote, escaped characters are skipped in pairs
+    pos = first_escape;
+    while (pos < len && text[pos] == '\\') {
+        pos = find_string_special(text, pos + 2, len);
+    }
+    // Stopped at the end of input or at a raw control character
+    if (pos >= len || text[pos] != '"') {
+        return context->pos;
     }
 
-    const u32 starting_pos = context->pos + 1;
+    // Decoded strings are never longer than their escaped source
     const u32 count = pos - starting_pos;
-    token->str = (char *)malloc(count + 1);
-    memset(token->str, 0, count + 1);
-    memcpy(token->str, &(text[starting_pos]), count);
+    char *str = (char *)malloc(count + 1);
+    if (str == NULL) {
+        return context->pos;
+    }
+
+    u32 str_len = 0;
+    u32 run = starting_pos;
+    u32 cur = first_escape;
+    for (;;) {
+        // Clean runs can't split a UTF-8 sequence, the delimiters are ASCII
+        if (!json_utf8_validate(&(text[run]), cur - run)) {
+            free(str);
+            return context->pos;
+        }
+        memcpy(&(str[str_len]), &(text[run]), cur - run);
+        str_len += cur - run;
+
+        if (text[cur] == '"') {
+            break;
+        }
+
+        run = decode_escape(context, cur, str, &str_len);
+        if (run == 0) {
+            free(str);
+            return context->pos;
+        }
+        cur = find_string_special(text, run, len);
+    }
+
+    str[str_len] = 0;
+    token->str = str;
     token->type = TOKEN_STRING;
 
     pos++;
@@ -170,7 +646,9 @@ __json_token_t next_token(json_context_t *context) {
     const char *text = context->text;
 
     context->pos = skip_spaces(context);
+    context->tokstart = context->pos;
     __json_token_t token = {0};
+    token.type = TOKEN_NONE;
     if (text[context->pos] == JSON_OBJECT_START) { 
         token.type = TOKEN_OBJECT_START; context->pos++;
     } else if (text[context->pos] == JSON_OBJECT_END) {
@@ -195,248 +673,1187 @@ __json_token_t next_token(json_context_t *context) {
         token.type = TOKEN_COLUMN; context->pos++;
     }
 
+    // No token before the end of input means it is malformed
+    if (token.type == TOKEN_NONE && context->pos < context->len) {
+        context->err = JSON_PARSE_ERR;
+    }
+
     return token;
 }
 
+static
+void span_free(__json_span_t *span) {
+    for (u32 i=0; i<span->count; i++) {
+        span_free(&(span->children[i]));
+    }
+    free(span->children);
+    span->count = 0;
+    span->children = NULL;
+}
+
+// Room for `len` child spans, always succeeds when spans aren't recorded
+static
+BOOL span_reserve(__json_span_t *span, const u32 len) {
+    if (span == NULL) {
+        return TRUE;
+    }
+    __json_span_t *children = (__json_span_t *)realloc(span->children,
+            sizeof(__json_span_t) * len);
+    if (children == NULL) {
+        return FALSE;
+    }
+    span->children = children;
+    return TRUE;
+}
+
+/*
+ * Containers are built in place so a failure can release whatever was
+ * parsed with json_free, on error the value owns nothing.
+ */
 u32 parse_array(json_context_t *context, json_value_t *value) {
-    advance(context, TOKEN_ARRAY_START);
+    const u32 start = context->tokstart;
+    __json_span_t *span = context->span;
+    u32 err = advance(context, TOKEN_ARRAY_START);
+    if (err) {
+        return err;
+    }
+
     u32 len = 4;
-    u32 values_size = sizeof(json_value_t) * len;
-    json_value_t *values = malloc(values_size);
+    json_array_t *array = &(value->array);
+    value->type = JSON_TYPE_ARRAY;
+    array->__cap = sizeof(json_value_t) * len;
+    array->len = 0;
+    array->values = (json_value_t *)malloc(array->__cap);
+    if (array->values == NULL) {
+        value->type = JSON_TYPE_NULL;
+        return JSON_ALLOC_FAILED_ERR;
+    }
+    if (!span_reserve(span, len)) {
+        json_free(value);
+        return JSON_ALLOC_FAILED_ERR;
+    }
+
+    if (context->curtok.type == TOKEN_ARRAY_END) {
+        err = advance(context, TOKEN_ARRAY_END);
+        if (err) {
+            json_free(value);
+        }
+        return err;
+    }
 
-    u32 i;
-    for (i=0;; i++) {
+    for (;;) {
         json_value_t parsed_value;
+        __json_span_t parsed_span;
 
-        u32 parse_err = parse_value(context, &parsed_value);
-        if (parse_err) {
-            return parse_err;
+        context->span = span != NULL ? &parsed_span : NULL;
+        err = parse_value(context, &parsed_value);
+        if (err) {
+            break;
         }
 
-        if (i == len) {
+        if (array->len == len) {
             len += len / 2;
             json_value_t *new_values =
-                (json_value_t *)realloc(values, sizeof(json_value_t) * len);
-            if (new_values == NULL) {
-                free(values);
-                return JSON_ALLOC_FAILED_ERR;
+                (json_value_t *)realloc(array->values, sizeof(json_value_t) * len);
+            if (new_values != NULL) {
+                array->values = new_values;
+                array->__cap = sizeof(json_value_t) * len;
+            }
+            if (new_values == NULL || !span_reserve(span, len)) {
+                json_free(&parsed_value);
+                if (span != NULL) {
+                    span_free(&parsed_span);
+                }
+                err = JSON_ALLOC_FAILED_ERR;
+                break;
             }
-            values = new_values;
         }
 
-        values[i] = parsed_value;
+        if (span != NULL) {
+            parsed_span.start -= start;
+            span->children[span->count++] = parsed_span;
+        }
+        array->values[array->len++] = parsed_value;
 
         if (context->curtok.type != TOKEN_COMMA) {
-            assert(context->curtok.type == TOKEN_ARRAY_END);
-            i++;
+            err = advance(context, TOKEN_ARRAY_END);
             break;
         }
 
-        advance(context, TOKEN_COMMA);
+        err = advance(context, TOKEN_COMMA);
+        if (err) {
+            break;
+        }
     }
 
-    value->array.__cap = sizeof(json_value_t) * len;
-    value->array.len = i;
-    value->array.values = values;
-
-    advance(context, TOKEN_ARRAY_END);
-    return NONE;
+    if (err) {
+        json_free(value);
+    }
+    return err;
 }
 
 u32 parse_object(json_context_t *context, json_value_t *value) {
-    advance(context, TOKEN_OBJECT_START);
+    const u32 start = context->tokstart;
+    __json_span_t *span = context->span;
+    u32 err = advance(context, TOKEN_OBJECT_START);
+    if (err) {
+        return err;
+    }
 
     u32 len = 32;
-    char **keys = (char **)malloc(sizeof(char *) * len);
-    json_property_t *props = (json_property_t *)malloc(sizeof(json_property_t) * len);
-    memset(props, 0, sizeof(json_property_t) * len);
+    json_object_t *object = &(value->object);
+    value->type = JSON_TYPE_OBJECT;
+    object->__keys_cap = sizeof(char *) * len;
+    object->__props_cap = sizeof(json_property_t) * len;
+    object->len = 0;
+    object->keys = (char **)malloc(object->__keys_cap);
+    object->props = (json_property_t *)malloc(object->__props_cap);
+    if (object->keys == NULL || object->props == NULL
+            || !span_reserve(span, len)) {
+        json_free(value);
+        return JSON_ALLOC_FAILED_ERR;
+    }
+
+    if (context->curtok.type == TOKEN_OBJECT_END) {
+        err = advance(context, TOKEN_OBJECT_END);
+        if (err) {
+            json_free(value);
+        }
+        return err;
+    }
 
-    u32 i;
-    for (i=0;; i++) {
+    for (;;) {
         json_property_t prop;
+        __json_span_t parsed_span;
 
-        u32 parse_err = parse_property(context, &prop);
-        if (parse_err) {
-            return parse_err;
+        context->span = span != NULL ? &parsed_span : NULL;
+        err = parse_property(context, &prop);
+        if (err) {
+            break;
         }
 
-        if (i == len) {
+        if (object->len == len) {
             len += len / 2;
-            props = realloc(props, sizeof(json_property_t) * len);
-            keys = realloc(keys, sizeof(char *) * len);
-            if (props == NULL || keys == NULL) {
-                free(props); free(keys);
-                return JSON_ALLOC_FAILED_ERR;
+            json_property_t *props = (json_property_t *)realloc(object->props,
+                    sizeof(json_property_t) * len);
+            if (props != NULL) {
+                object->props = props;
+                object->__props_cap = sizeof(json_property_t) * len;
+            }
+            char **keys = (char **)realloc(object->keys, sizeof(char *) * len);
+            if (keys != NULL) {
+                object->keys = keys;
+                object->__keys_cap = sizeof(char *) * len;
+            }
+            if (props == NULL || keys == NULL || !span_reserve(span, len)) {
+                free(prop.key);
+                json_free(&(prop.value));
+                if (span != NULL) {
+                    span_free(&parsed_span);
+                }
+                err = JSON_ALLOC_FAILED_ERR;
+                break;
             }
         }
 
-        props[i] = prop;
-        keys[i] = prop.key;
+        if (span != NULL) {
+            parsed_span.start -= start;
+            span->children[span->count++] = parsed_span;
+        }
+        object->props[object->len] = prop;
+        object->keys[object->len] = prop.key;
+        object->len++;
 
         if (context->curtok.type != TOKEN_COMMA) {
+            err = advance(context, TOKEN_OBJECT_END);
             break;
         }
 
-        advance(context, TOKEN_COMMA);
+        err = advance(context, TOKEN_COMMA);
+        if (err) {
+            break;
+        }
     }
 
-    value->object.__keys_cap = sizeof(char *) * len;
-    value->object.__props_cap = sizeof(json_property_t) * len;
-    value->object.len = i + 1;
-    value->object.keys = keys;
-    value->object.props = props;
-
-    advance(context, TOKEN_OBJECT_END);
-    return NONE;
+    if (err) {
+        json_free(value);
+    }
+    return err;
 }
 
 u32 parse_value(json_context_t *context, json_value_t *value) {
     __json_token_t token = context->curtok;
+    const u32 start = context->tokstart;
+    __json_span_t *span = context->span;
+    u32 parse_err = NONE;
+
+    if (span != NULL) {
+        span->count = 0;
+        span->children = NULL;
+    }
 
     switch (token.type) {
     case TOKEN_OBJECT_START:
-        value->type = JSON_TYPE_OBJECT;
-        return parse_object(context, value);
+        parse_err = parse_object(context, value);
+        break;
     case TOKEN_ARRAY_START:
-        value->type = JSON_TYPE_ARRAY;
-        return parse_array(context, value);
+        parse_err = parse_array(context, value);
+        break;
     case TOKEN_NUMBER:
         value->type = JSON_TYPE_NUMBER;
         value->number = token.number;
-        advance(context, TOKEN_NUMBER);
+        parse_err = advance(context, TOKEN_NUMBER);
         break;
     case TOKEN_STRING:
         value->type = JSON_TYPE_STRING;
         value->str = token.str;
-        advance(context, TOKEN_STRING);
+        parse_err = advance(context, TOKEN_STRING);
+        if (parse_err) {
+            free(token.str);
+        }
         break;
     case TOKEN_FALSE:
         value->type = JSON_TYPE_BOOL;
         value->boolean = token.boolean;
-        advance(context, TOKEN_FALSE);
+        parse_err = advance(context, TOKEN_FALSE);
         break;
     case TOKEN_TRUE:
         value->type = JSON_TYPE_BOOL;
         value->boolean = token.boolean;
-        advance(context, TOKEN_TRUE);
+        parse_err = advance(context, TOKEN_TRUE);
         break;
     case TOKEN_NULL:
         value->type = JSON_TYPE_NULL;
-        advance(context, TOKEN_NULL);
+        parse_err = advance(context, TOKEN_NULL);
         break;
     default:
-        assert(FALSE && "unreachale!");
+        parse_err = JSON_PARSE_ERR;
     }
 
-    return NONE;
+    if (span != NULL) {
+        if (parse_err) {
+            span_free(span);
+        }
+        span->start = start;
+        span->len = context->prev_end - start;
+    }
+    return parse_err;
 }
 
 u32 parse_property(json_context_t *context, json_property_t *prop) {
     __json_token_t prop_name = context->curtok;
-    advance(context, TOKEN_STRING);
-    advance(context, TOKEN_COLUMN);
-    json_value_t prop_value;
+    if (prop_name.type != TOKEN_STRING) {
+        return JSON_PARSE_ERR;
+    }
 
-    u32 value_result = parse_value(context, &prop_value);
+    // The name is owned here once consumed
+    u32 err = advance(context, TOKEN_STRING);
+    if (!err) {
+        err = advance(context, TOKEN_COLUMN);
+    }
+    if (!err) {
+        err = parse_value(context, &(prop->value));
+    }
+    if (err) {
+        free(prop_name.str);
+        return err;
+    }
 
     prop->key = prop_name.str;
-    prop->value = prop_value;
-
-    return value_result;
+    return NONE;
 }
 
-u32 json_parse(json_value_t *value, const char *text, const u32 len) {
-    JSON_ASSERT(value != NULL);
-
+static
+u32 parse_root(json_value_t *value, const char *text, const u32 len,
+        __json_span_t *span) {
     json_context_t context = {0};
     context.len = len;
     context.text = (char *)text;
     context.curtok = next_token(&context);
+    const u32 start = context.tokstart;
 
-    if (context.curtok.type == TOKEN_ARRAY_START) {
-        u32 parse_err = parse_array(&context, value);
-        value->type = JSON_TYPE_ARRAY;
-        return parse_err;
+    if (span != NULL) {
+        span->count = 0;
+        span->children = NULL;
     }
+    context.span = span;
 
-    u32 parse_err = parse_object(&context, value);
-    value->type = JSON_TYPE_OBJECT;
-    return parse_err;
-}
+    u32 parse_err = context.err;
+    if (!parse_err) {
+        parse_err = context.curtok.type == TOKEN_ARRAY_START
+            ? parse_array(&context, value)
+            : parse_object(&context, value);
+    }
 
-json_value_type_t __json_value_type(const json_object_t object,
-        const char *key) {
-    for (u32 i=0;
-            i<object.len;
-            i++) {
-        if (!strcmp(object.props[i].key, key)) {
-            return object.props[i].value.type;
+    // Only the end of input may follow the root
+    if (!parse_err && context.curtok.type != TOKEN_NONE) {
+        json_free(value);
+        parse_err = JSON_PARSE_ERR;
+    }
+    if (parse_err) {
+        // The lookahead is the only token not handed to a value
+        if (context.curtok.type == TOKEN_STRING) {
+            free(context.curtok.str);
         }
+        if (span != NULL) {
+            span_free(span);
+        }
+        value->type = JSON_TYPE_NULL;
+        return parse_err;
     }
 
-    return JSON_TYPE_NONE;
+    if (span != NULL) {
+        span->start = start;
+        span->len = context.prev_end - start;
+    }
+    return NONE;
 }
 
-void * __json_object_get_raw(json_object_t object,
-        const char **keys, const u32 len) {
-
-    json_value_t *sub_value = NULL;
+u32 json_parse(json_value_t *value, const char *text, const u32 len) {
+    JSON_ASSERT(value != NULL);
+    return parse_root(value, text, len, NULL);
+}
 
-    for (u32 k=0;
-            k<len;
-            k++
-        ) {
-        const char *key = keys[k];
-        if (sub_value != NULL) {
-            assert(sub_value->type == JSON_TYPE_OBJECT);
-            object = sub_value->object;
+void json_free(json_value_t *value) {
+    switch (value->type) {
+    case JSON_TYPE_STRING:
+        free(value->str);
+        break;
+    case JSON_TYPE_ARRAY:
+        for (u32 i=0; i<value->array.len; i++) {
+            json_free(&(value->array.values[i]));
         }
-
-        for (u32 i=0;
-                i<object.len;
-                i++) {
-            if (!strcmp(object.props[i].key, key)) {
-                json_value_t *v = &(object.props[i].value);
-                switch (v->type) {
-                case JSON_TYPE_BOOL:
-                    return &(v->boolean);
-                case JSON_TYPE_STRING:
-                    return &(v->str);
-                case JSON_TYPE_NUMBER:
-                    return &(v->number);
-                default:
-                    sub_value = v;
-                    break;
-                }
+        free(value->array.values);
+        break;
+    case JSON_TYPE_OBJECT:
+        for (u32 i=0; i<value->object.len; i++) {
+            // Parsed objects share key strings, JSON_SET copies them
+            if (value->object.keys[i] != value->object.props[i].key) {
+                free(value->object.keys[i]);
             }
+            free(value->object.props[i].key);
+            json_free(&(value->object.props[i].value));
         }
+        free(value->object.keys);
+        free(value->object.props);
+        break;
+    default:
+        break;
     }
-
-    return sub_value;
+    value->type = JSON_TYPE_NULL;
 }
 
-void * __json_array_get_raw(const json_array_t array, const u32 idx) {
-    if (idx >= array.len) return NULL;
+#define REPARSE_REJECTED 0xFF
 
-    json_value_t *v = &(array.values[idx]);
+/*
+ * Checks text[start..end) holds exactly one value: brackets balance,
+ * strings are closed and nothing is separated by ',' or ':' at depth 0.
+ * The text before start is unchanged, so start is never inside a string.
+ */
+static
+BOOL is_single_value(const char *text, const u32 start, const u32 end) {
+    u32 depth = 0;
+    u32 pos = skip_whitespace(text, start, end);
+    if (pos >= end) {
+        return FALSE;
+    }
 
-    switch (v->type) {
-    case JSON_TYPE_BOOL:
-        return &(v->boolean);
-    case JSON_TYPE_STRING:
-        return &(v->str);
-    case JSON_TYPE_NUMBER:
-        return &(v->number);
-    default:
-        return v;
+    while (pos < end) {
+        const char c = text[pos];
+        if (c == '"') {
+            pos = find_quote_or_escape(text, pos + 1, end);
+            while (pos < end && text[pos] == '\\') {
+                pos = find_quote_or_escape(text, pos + 2, end);
+            }
+            if (pos >= end) return FALSE;
+        } else if (c == JSON_OBJECT_START || c == JSON_ARRAY_START) {
+            depth++;
+        } else if (c == JSON_OBJECT_END || c == JSON_ARRAY_END) {
+            if (depth == 0) return FALSE;
+            depth--;
+        } else if (depth == 0 && (c == JSON_COMMA || c == JSON_COLUMN)) {
+            return FALSE;
+        }
+        pos++;
+        // Anything after a closed container at depth 0 is a second value
+        if (depth == 0 && (c == JSON_OBJECT_END || c == JSON_ARRAY_END
+                    || c == '"')) {
+            return skip_whitespace(text, pos, end) == end;
+        }
     }
+
+    return depth == 0;
 }
 
-#define __JSON_VALUE_ON_TYPE(__VALUE, __VALUE_PTR, __TYPE)\
-    do {switch (__TYPE) {\
-        case JSON_TYPE_NUMBER:\
-            *(__VALUE_PTR) = &(__VALUE.number);\
-            break;\
+static
+u32 reparse_value(json_document_t *document, json_value_t *value,
+        __json_span_t *span, const u32 abs_start, const u32 new_len) {
+    const u32 end = abs_start + new_len;
+    if (!is_single_value(document->text, abs_start, end)) {
+        return REPARSE_REJECTED;
+    }
+
+    json_value_t parsed;
+    __json_span_t parsed_span;
+    json_context_t context = {0};
+    context.len = document->len;
+    context.text = document->text;
+    context.pos = abs_start;
+    context.curtok = next_token(&context);
+    context.span = &parsed_span;
+
+    u32 parse_err = parse_value(&context, &parsed);
+    // The lookahead past a value is never a string in valid input
+    if (context.curtok.type == TOKEN_STRING) {
+        free(context.curtok.str);
+    }
+    if (parse_err) {
+        return parse_err;
+    }
+    if (skip_whitespace(document->text,
+                parsed_span.start + parsed_span.len, end) != end) {
+        json_free(&parsed);
+        span_free(&parsed_span);
+        return REPARSE_REJECTED;
+    }
+
+    // Whitespace around the value stays with the parent
+    parsed_span.start = span->start + (parsed_span.start - abs_start);
+    json_free(value);
+    span_free(span);
+    *value = parsed;
+    *span = parsed_span;
+    return NONE;
+}
+
+static
+json_value_t *value_child(json_value_t *value, const u32 idx) {
+    return value->type == JSON_TYPE_ARRAY
+        ? &(value->array.values[idx])
+        : &(value->object.props[idx].value);
+}
+
+/*
+ * Re-parses the smallest value around the old text range [start, end),
+ * then grows the spans on the way back up. Children are ordered by
+ * their start, so the candidate child is found by binary search.
+ */
+static
+u32 document_reparse(json_document_t *document, json_value_t *value,
+        __json_span_t *span, const u32 abs_start, const u32 start,
+        const u32 end, const i64 delta) {
+    __json_span_t *children = span->children;
+
+    u32 lo = 0, hi = span->count;
+    while (lo < hi) {
+        const u32 mid = lo + (hi - lo) / 2;
+        if (children[mid].start <= start - abs_start) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (lo > 0) {
+        __json_span_t *child = &(children[lo - 1]);
+        const u32 child_start = abs_start + child->start;
+        if (end <= child_start + child->len) {
+            const u32 err = document_reparse(document,
+                    value_child(value, lo - 1), child, child_start,
+                    start, end, delta);
+            if (err != REPARSE_REJECTED) {
+                if (err) {
+                    return err;
+                }
+                for (u32 i=lo; i<span->count; i++) {
+                    children[i].start += delta;
+                }
+                span->len += delta;
+                return NONE;
+            }
+        }
+    }
+
+    return reparse_value(document, value, span, abs_start,
+            (u32)((i64)span->len + delta));
+}
+
+u32 json_document_parse(json_document_t *document, const char *text,
+        const u32 len) {
+    JSON_ASSERT(document != NULL);
+    memset(document, 0, sizeof(json_document_t));
+
+    // Keep a NUL past the end, the tokenizer relies on it
+    document->__cap = len + 1;
+    document->text = (char *)malloc(document->__cap);
+    if (document->text == NULL) {
+        return JSON_ALLOC_FAILED_ERR;
+    }
+    memcpy(document->text, text, len);
+    document->text[len] = 0;
+    document->len = len;
+
+    return parse_root(&(document->root), document->text, len,
+            &(document->__span));
+}
+
+static
+u32 document_splice(json_document_t *document, const u32 start,
+        const u32 end, const char *text, const u32 len) {
+    const u32 new_len = document->len - (end - start) + len;
+    if (new_len + 1 > document->__cap) {
+        u32 cap = document->__cap + document->__cap / 2;
+        if (cap < new_len + 1) cap = new_len + 1;
+        char *new_text = (char *)realloc(document->text, cap);
+        if (new_text == NULL) {
+            return JSON_ALLOC_FAILED_ERR;
+        }
+        document->text = new_text;
+        document->__cap = cap;
+    }
+    memmove(&(document->text[start + len]), &(document->text[end]),
+            document->len - end);
+    memcpy(&(document->text[start]), text, len);
+    document->len = new_len;
+    document->text[new_len] = 0;
+    return NONE;
+}
+
+static
+u32 document_apply(json_document_t *document, const u32 start,
+        const u32 end, const u32 len) {
+    json_value_t *root = &(document->root);
+    __json_span_t *root_span = &(document->__span);
+    const u32 root_start = root_span->start;
+    if (start >= root_start && end <= root_start + root_span->len) {
+        // Failed re-parses leave the tree untouched
+        const u32 err = document_reparse(document, root, root_span,
+                root_start, start, end, (i64)len - (i64)(end - start));
+        if (err == NONE) {
+            return NONE;
+        }
+    }
+
+    json_value_t parsed;
+    __json_span_t parsed_span;
+    const u32 err = parse_root(&parsed, document->text, document->len,
+            &parsed_span);
+    if (err) {
+        return err;
+    }
+    json_free(root);
+    span_free(root_span);
+    *root = parsed;
+    *root_span = parsed_span;
+    return NONE;
+}
+
+u32 json_document_edit(json_document_t *document, const u32 start,
+        const u32 end, const char *text, const u32 len) {
+    if (start > end || end > document->len) {
+        return JSON_LEN_MISMATCH_ERR;
+    }
+
+    // Kept to put the text back when the edit doesn't parse
+    char *replaced = (char *)malloc(end - start + 1);
+    if (replaced == NULL) {
+        return JSON_ALLOC_FAILED_ERR;
+    }
+    memcpy(replaced, &(document->text[start]), end - start);
+
+    u32 err = document_splice(document, start, end, text, len);
+    if (err == NONE) {
+        err = document_apply(document, start, end, len);
+        if (err) {
+            // Never grows the text, it can't fail
+            document_splice(document, start, start + len, replaced,
+                    end - start);
+        }
+    }
+
+    free(replaced);
+    return err;
+}
+
+void json_document_free(json_document_t *document) {
+    json_free(&(document->root));
+    span_free(&(document->__span));
+    free(document->text);
+    memset(document, 0, sizeof(json_document_t));
+}
+
+static inline
+BOOL is_delimiter(const char c) {
+    return is_whitespace(c) || c == JSON_COMMA || c == JSON_COLUMN
+        || c == JSON_ARRAY_START || c == JSON_ARRAY_END
+        || c == JSON_OBJECT_START || c == JSON_OBJECT_END || c == '"';
+}
+
+static
+void out_flush(json_transcoder_t *t) {
+    if (t->__out_len && !t->err
+            && t->sink(t->user, t->__out, t->__out_len)) {
+        t->err = JSON_SINK_ERR;
+    }
+    t->__out_len = 0;
+}
+
+static
+void out_write(json_transcoder_t *t, const char *data, const u32 len) {
+    if (t->__out_len + len > JSON_TRANSCODE_BUF_SIZE) {
+        out_flush(t);
+        // Large runs skip the staging buffer
+        if (len >= JSON_TRANSCODE_BUF_SIZE) {
+            if (!t->err && t->sink(t->user, data, len)) {
+                t->err = JSON_SINK_ERR;
+            }
+            return;
+        }
+    }
+    memcpy(&(t->__out[t->__out_len]), data, len);
+    t->__out_len += len;
+}
+
+// Gives up sorting whatever is in the window and streams it out as is
+static
+void window_spill(json_transcoder_t *t) {
+    out_write(t, t->__window, t->__window_len);
+    t->__window_len = 0;
+    t->__members_len = 0;
+    t->__frames_len = 0;
+    t->__buffering = FALSE;
+}
+
+static
+void emit(json_transcoder_t *t, const char *data, const u32 len) {
+    if (t->__buffering) {
+        if (t->__window_len + len <= t->__window_cap) {
+            memcpy(&(t->__window[t->__window_len]), data, len);
+            t->__window_len += len;
+            return;
+        }
+        window_spill(t);
+    }
+    out_write(t, data, len);
+}
+
+static
+void emit_newline(json_transcoder_t *t) {
+    static const char spaces[] = "                                ";
+    if (t->indent == 0) {
+        return;
+    }
+    emit(t, "\n", 1);
+    u32 left = t->indent * t->depth;
+    while (left) {
+        const u32 n = left < sizeof(spaces) - 1 ? left : sizeof(spaces) - 1;
+        emit(t, spaces, n);
+        left -= n;
+    }
+}
+
+static inline
+i32 member_cmp(const char *window, const __json_member_span_t *a,
+        const __json_member_span_t *b) {
+    const u32 a_len = a->key_end - a->start;
+    const u32 b_len = b->key_end - b->start;
+    const i32 cmp = memcmp(&(window[a->start]), &(window[b->start]),
+            a_len < b_len ? a_len : b_len);
+    if (cmp) return cmp;
+    if (a_len != b_len) return a_len < b_len ? -1 : 1;
+    // Duplicate keys keep their source order
+    return a->start < b->start ? -1 : 1;
+}
+
+static
+void members_sift_down(const char *window, __json_member_span_t *members,
+        u32 root, const u32 len) {
+    for (;;) {
+        u32 child = root * 2 + 1;
+        if (child >= len) return;
+        if (child + 1 < len
+                && member_cmp(window, &(members[child]), &(members[child + 1])) < 0) {
+            child++;
+        }
+        if (member_cmp(window, &(members[root]), &(members[child])) >= 0) return;
+        const __json_member_span_t tmp = members[root];
+        members[root] = members[child];
+        members[child] = tmp;
+        root = child;
+    }
+}
+
+static
+void sort_frame(json_transcoder_t *t, const __json_sort_frame_t *frame) {
+    __json_member_span_t *members = &(t->__members[frame->first_member]);
+    const u32 len = t->__members_len - frame->first_member;
+    if (len < 2) {
+        return;
+    }
+
+    // Every member is followed by the same separator, take the first one
+    const u32 region_start = members[0].start;
+    const u32 region_end = members[len - 1].end;
+    const u32 sep_start = members[0].end;
+    const u32 sep_len = members[1].start - members[0].end;
+
+    for (u32 i=len/2; i>0; i--) {
+        members_sift_down(t->__window, members, i - 1, len);
+    }
+    for (u32 i=len-1; i>0; i--) {
+        const __json_member_span_t tmp = members[0];
+        members[0] = members[i];
+        members[i] = tmp;
+        members_sift_down(t->__window, members, 0, i);
+    }
+
+    u32 n = 0;
+    for (u32 i=0; i<len; i++) {
+        if (i) {
+            memcpy(&(t->__scratch[n]), &(t->__window[sep_start]), sep_len);
+            n += sep_len;
+        }
+        const u32 member_len = members[i].end - members[i].start;
+        memcpy(&(t->__scratch[n]), &(t->__window[members[i].start]), member_len);
+        n += member_len;
+    }
+    JSON_ASSERT(n == region_end - region_start);
+    memcpy(&(t->__window[region_start]), t->__scratch, n);
+}
+
+static inline
+__json_sort_frame_t *top_frame(json_transcoder_t *t) {
+    if (!t->__buffering || t->__frames_len == 0) return NULL;
+    __json_sort_frame_t *frame = &(t->__frames[t->__frames_len - 1]);
+    return frame->depth == t->depth ? frame : NULL;
+}
+
+static
+void end_member(json_transcoder_t *t) {
+    __json_sort_frame_t *frame = top_frame(t);
+    if (frame != NULL && t->__members_len > frame->first_member) {
+        t->__members[t->__members_len - 1].end = t->__window_len;
+    }
+}
+
+static
+void open_container(json_transcoder_t *t, const char c) {
+    if (c == JSON_OBJECT_START && t->__window_cap) {
+        if (t->__frames_len == JSON_TRANSCODE_MAX_DEPTH) {
+            window_spill(t);
+        }
+        t->__buffering = TRUE;
+    }
+    emit(t, &c, 1);
+    t->depth++;
+    t->pending_newline = TRUE;
+    t->expect_key = c == JSON_OBJECT_START;
+
+    if (c == JSON_OBJECT_START && t->__buffering) {
+        __json_sort_frame_t *frame = &(t->__frames[t->__frames_len++]);
+        frame->depth = t->depth;
+        frame->first_member = t->__members_len;
+    }
+}
+
+static
+void close_container(json_transcoder_t *t, const char c) {
+    if (t->depth == 0) {
+        t->err = JSON_UNBALANCED_ERR;
+        return;
+    }
+
+    __json_sort_frame_t *frame = c == JSON_OBJECT_END ? top_frame(t) : NULL;
+    if (t->pending_newline) {
+        t->pending_newline = FALSE;
+        t->depth--;
+    } else {
+        end_member(t);
+        t->depth--;
+        emit_newline(t);
+    }
+    t->expect_key = FALSE;
+
+    if (frame != NULL && t->__buffering) {
+        sort_frame(t, frame);
+        t->__members_len = frame->first_member;
+        t->__frames_len--;
+    }
+    emit(t, &c, 1);
+    if (t->__buffering && t->__frames_len == 0) {
+        window_spill(t);
+    }
+}
+
+static
+void begin_string(json_transcoder_t *t) {
+    __json_sort_frame_t *frame = t->expect_key ? top_frame(t) : NULL;
+    t->expect_key = FALSE;
+    if (frame != NULL) {
+        if (t->__members_len == t->__members_cap) {
+            window_spill(t);
+        } else {
+            __json_member_span_t *member = &(t->__members[t->__members_len++]);
+            member->start = t->__window_len;
+            member->key_end = member->end = t->__window_len;
+            t->in_key = TRUE;
+        }
+    }
+    emit(t, "\"", 1);
+    t->in_string = TRUE;
+}
+
+static
+void end_string(json_transcoder_t *t) {
+    t->in_string = FALSE;
+    if (t->in_key) {
+        t->in_key = FALSE;
+        if (t->__buffering) {
+            t->__members[t->__members_len - 1].key_end = t->__window_len;
+        }
+    }
+}
+
+#ifdef JSON_SSE2
+/*
+ * Minifying without sorting outputs the input minus the whitespace
+ * outside strings, so whole blocks are compacted straight into the
+ * staging buffer. Quotes are turned into a mask of the bytes inside
+ * strings with a prefix XOR, a block is cut at its first backslash so
+ * escapes are copied in pairs. Returns where the per-byte loop has to
+ * take over: the last partial block, an escape split by the chunk end
+ * or a block closing more containers than are open.
+ */
+static
+u32 minify_blocks(json_transcoder_t *t, const char *chunk, u32 pos,
+        const u32 len) {
+    // Kept in locals, stores through the char buffer would alias them
+    char *out = t->__out;
+    u32 out_len = t->__out_len;
+    u32 depth = t->depth;
+    u32 in_string = t->in_string ? 0xFFFF : 0;
+
+    while (pos + 16 <= len) {
+        // Room for a block, the last run store and an escape pair
+        if (out_len + 32 > JSON_TRANSCODE_BUF_SIZE) {
+            t->__out_len = out_len;
+            out_flush(t);
+            out_len = 0;
+            if (t->err) {
+                break;
+            }
+        }
+
+        const __m128i block = _mm_loadu_si128((const __m128i *)&(chunk[pos]));
+        const u32 ws = (u32)_mm_movemask_epi8(_mm_or_si128(
+                    _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8(' ')),
+                        _mm_cmpeq_epi8(block, _mm_set1_epi8('\n'))),
+                    _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8('\t')),
+                        _mm_cmpeq_epi8(block, _mm_set1_epi8('\r')))));
+        const u32 quote = (u32)_mm_movemask_epi8(
+                _mm_cmpeq_epi8(block, _mm_set1_epi8('"')));
+        const u32 escape = (u32)_mm_movemask_epi8(
+                _mm_cmpeq_epi8(block, _mm_set1_epi8('\\')));
+        const u32 opens = (u32)_mm_movemask_epi8(_mm_or_si128(
+                    _mm_cmpeq_epi8(block, _mm_set1_epi8(JSON_OBJECT_START)),
+                    _mm_cmpeq_epi8(block, _mm_set1_epi8(JSON_ARRAY_START))));
+        const u32 closes = (u32)_mm_movemask_epi8(_mm_or_si128(
+                    _mm_cmpeq_epi8(block, _mm_set1_epi8(JSON_OBJECT_END)),
+                    _mm_cmpeq_epi8(block, _mm_set1_epi8(JSON_ARRAY_END))));
+
+        const u32 n = escape ? (u32)__builtin_ctz(escape) : 16;
+        const u32 prefix = (u32)((1ull << n) - 1);
+
+        // Opening quotes and the bytes after them up to the closing one
+        u32 inside = quote & prefix;
+        inside ^= inside << 1;
+        inside ^= inside << 2;
+        inside ^= inside << 4;
+        inside ^= inside << 8;
+        inside = (inside ^ in_string) & prefix;
+
+        const u32 structural = prefix & ~inside & ~quote;
+        if ((opens | closes) & structural) {
+            const u32 closed = (u32)__builtin_popcount(closes & structural);
+            if (closed > depth) {
+                break;
+            }
+            depth = depth + (u32)__builtin_popcount(opens & structural)
+                - closed;
+        }
+        if (n) {
+            in_string = (inside >> (n - 1)) & 1 ? 0xFFFF : 0;
+        }
+
+        u32 keep = (~ws | inside | quote) & prefix;
+        if (keep == 0xFFFF) {
+            _mm_storeu_si128((__m128i *)&(out[out_len]), block);
+            out_len += 16;
+        } else {
+            // Runs are copied with whole block stores, the next run
+            // overwrites the excess. The last block of the chunk is
+            // staged so the loads never read past it.
+            const char *src = &(chunk[pos]);
+            char bytes[32];
+            if (pos + 32 > len) {
+                _mm_storeu_si128((__m128i *)bytes, block);
+                _mm_storeu_si128((__m128i *)&(bytes[16]), _mm_setzero_si128());
+                src = bytes;
+            }
+            while (keep) {
+                const u32 start = (u32)__builtin_ctz(keep);
+                const u32 run = (u32)__builtin_ctz(~(keep >> start));
+                _mm_storeu_si128((__m128i *)&(out[out_len]),
+                        _mm_loadu_si128((const __m128i *)&(src[start])));
+                out_len += run;
+                keep &= ~(((1u << run) - 1) << start);
+            }
+        }
+        pos += n;
+        if (n == 16) {
+            continue;
+        }
+
+        // Backslashes only make sense inside strings, the rest is left
+        // to the per-byte loop
+        if (!in_string || pos + 1 >= len) {
+            break;
+        }
+        out[out_len++] = chunk[pos];
+        out[out_len++] = chunk[pos + 1];
+        pos += 2;
+    }
+
+    t->__out_len = out_len;
+    t->depth = depth;
+    t->in_string = in_string != 0;
+    return pos;
+}
+#endif
+
+u32 json_transcoder_init(json_transcoder_t *transcoder, const u32 indent,
+        const u32 sort_window, json_sink_t sink, void *user) {
+    JSON_ASSERT(transcoder != NULL && sink != NULL);
+    memset(transcoder, 0, sizeof(json_transcoder_t));
+    transcoder->sink = sink;
+    transcoder->user = user;
+    transcoder->indent = indent;
+
+    if (sort_window) {
+        // Smallest member is `"":0` plus its separator
+        transcoder->__members_cap = sort_window / 4 + 1;
+        transcoder->__window = (char *)malloc(sort_window);
+        transcoder->__scratch = (char *)malloc(sort_window);
+        transcoder->__members = (__json_member_span_t *)malloc(
+                sizeof(__json_member_span_t) * transcoder->__members_cap);
+        if (transcoder->__window == NULL || transcoder->__scratch == NULL
+                || transcoder->__members == NULL) {
+            json_transcoder_free(transcoder);
+            return JSON_ALLOC_FAILED_ERR;
+        }
+        transcoder->__window_cap = sort_window;
+    }
+
+    return NONE;
+}
+
+u32 json_transcode(json_transcoder_t *transcoder, const char *chunk,
+        const u32 len) {
+    json_transcoder_t *t = transcoder;
+    u32 pos = 0;
+#ifdef JSON_SSE2
+    const BOOL minify = t->indent == 0 && t->__window_cap == 0;
+#endif
+
+    while (pos < len && !t->err) {
+        if (t->in_escape) {
+            t->in_escape = FALSE;
+            emit(t, &(chunk[pos]), 1);
+            pos++;
+            continue;
+        }
+
+        if (t->in_string) {
+            const u32 end = find_quote_or_escape(chunk, pos, len);
+            if (end >= len) {
+                emit(t, &(chunk[pos]), len - pos);
+                break;
+            }
+            emit(t, &(chunk[pos]), end + 1 - pos);
+            if (chunk[end] == '\\') {
+                t->in_escape = TRUE;
+            } else {
+                end_string(t);
+            }
+            pos = end + 1;
+            continue;
+        }
+
+#ifdef JSON_SSE2
+        if (minify) {
+            pos = minify_blocks(t, chunk, pos, len);
+            // It may stop inside a string, the branch above resumes it
+            if (t->in_string) {
+                continue;
+            }
+        }
+#endif
+        pos = skip_whitespace(chunk, pos, len);
+        if (pos >= len) {
+            break;
+        }
+
+        const char c = chunk[pos];
+        if (c == JSON_OBJECT_END || c == JSON_ARRAY_END) {
+            close_container(t, c);
+            pos++;
+            continue;
+        }
+
+        if (t->pending_newline) {
+            t->pending_newline = FALSE;
+            emit_newline(t);
+        }
+
+        switch (c) {
+        case JSON_OBJECT_START:
+        case JSON_ARRAY_START:
+            open_container(t, c);
+            break;
+        case JSON_COMMA:
+            end_member(t);
+            t->expect_key = top_frame(t) != NULL;
+            emit(t, &c, 1);
+            t->pending_newline = TRUE;
+            break;
+        case JSON_COLUMN:
+            emit(t, ": ", t->indent ? 2 : 1);
+            break;
+        case '"':
+            begin_string(t);
+            break;
+        default: {
+            // Numbers and literals, possibly continuing from the last chunk
+            u32 end = pos;
+            while (end < len && !is_delimiter(chunk[end]))
+                end++;
+            emit(t, &(chunk[pos]), end - pos);
+            pos = end;
+            continue;
+        }
+        }
+        pos++;
+    }
+
+    return t->err;
+}
+
+u32 json_transcode_finish(json_transcoder_t *transcoder) {
+    if (transcoder->__buffering) {
+        window_spill(transcoder);
+    }
+    out_flush(transcoder);
+    if (!transcoder->err
+            && (transcoder->depth || transcoder->in_string)) {
+        transcoder->err = JSON_UNBALANCED_ERR;
+    }
+    return transcoder->err;
+}
+
+void json_transcoder_free(json_transcoder_t *transcoder) {
+    free(transcoder->__window);
+    free(transcoder->__scratch);
+    free(transcoder->__members);
+    transcoder->__window = NULL;
+    transcoder->__scratch = NULL;
+    transcoder->__members = NULL;
+    transcoder->__window_cap = 0;
+}
+
+static
+i64 object_index(const json_object_t *object, const char *key) {
+    for (u32 i=0;
+            i<object->len;
+            i++) {
+        if (!strcmp(object->props[i].key, key)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+json_value_type_t __json_value_type(const json_object_t object,
+        const char *key) {
+    for (u32 i=0;
+            i<object.len;
+            i++) {
+        if (!strcmp(object.props[i].key, key)) {
+            return object.props[i].value.type;
+        }
+    }
+
+    return JSON_TYPE_NONE;
+}
+
+void * __json_object_get_raw(json_object_t object,
+        const char **keys, const u32 len) {
+
+    json_value_t *sub_value = NULL;
+
+    for (u32 k=0;
+            k<len;
+            k++
+        ) {
+        const char *key = keys[k];
+        if (sub_value != NULL) {
+            assert(sub_value->type == JSON_TYPE_OBJECT);
+            object = sub_value->object;
+        }
+
+        const i64 idx = object_index(&object, key);
+        if (idx < 0) {
+            return NULL;
+        }
+
+        json_value_t *v = &(object.props[idx].value);
+        switch (v->type) {
+        case JSON_TYPE_BOOL:
+            return &(v->boolean);
+        case JSON_TYPE_STRING:
+            return &(v->str);
+        case JSON_TYPE_NUMBER:
+            return &(v->number);
+        default:
+            sub_value = v;
+            break;
+        }
+    }
+
+    return sub_value;
+}
+
+void * __json_array_get_raw(const json_array_t array, const u32 idx) {
+    if (idx >= array.len) return NULL;
+
+    json_value_t *v = &(array.values[idx]);
+
+    switch (v->type) {
+    case JSON_TYPE_BOOL:
+        return &(v->boolean);
+    case JSON_TYPE_STRING:
+        return &(v->str);
+    case JSON_TYPE_NUMBER:
+        return &(v->number);
+    default:
+        return v;
+    }
+}
+
+#define __JSON_VALUE_ON_TYPE(__VALUE, __VALUE_PTR, __TYPE)\
+    do {switch (__TYPE) {\
+        case JSON_TYPE_NUMBER:\
+            *(__VALUE_PTR) = &(__VALUE.number);\
+            break;\
         case JSON_TYPE_STRING:\
             *(__VALUE_PTR) = &(__VALUE.str);\
             break;\
@@ -454,81 +1871,1363 @@ void * __json_array_get_raw(const json_array_t array, const u32 idx) {
     }}while(0)
 
 
-void * __json_object_set_in_place(const json_object_t object, const char *key,
-        const json_value_type_t type) {
-    for (u32 i=0;
-            i<object.len;
-            i++) {
-        if (!strcmp(object.props[i].key, key)) {
-            object.props[i].value.type = type;
-            void *value_ptr = NULL;
-            __JSON_VALUE_ON_TYPE(object.props[i].value, &value_ptr, type);
-            return value_ptr;
+void * __json_object_set_in_place(const json_object_t object, const char *key,
+        const json_value_type_t type) {
+    for (u32 i=0;
+            i<object.len;
+            i++) {
+        if (!strcmp(object.props[i].key, key)) {
+            object.props[i].value.type = type;
+            void *value_ptr = NULL;
+            __JSON_VALUE_ON_TYPE(object.props[i].value, &value_ptr, type);
+            return value_ptr;
+        }
+    }
+    return NULL;
+}
+
+void * __json_object_add(json_object_t *object, const char *key,
+        const json_value_type_t type) {
+    // Check for any room left in mem
+    if ((object->len + 1) * sizeof(json_property_t) >= object->__props_cap) {
+        object->__props_cap += object->__props_cap / 2;
+        object->props = realloc(object->props, object->__props_cap);
+        JSON_ASSERT(object->props != NULL); // FIXME: return error to the caller
+    }
+    if ((object->len + 1) * sizeof(char) >= object->__keys_cap) {
+        object->__keys_cap += object->__keys_cap / 2;
+        object->keys = realloc(object->keys, object->__keys_cap);
+        JSON_ASSERT(object->keys != NULL); // FIXME: return error to the caller
+    }
+
+    const u32 len = object->len;
+    object->len++;
+    const u32 keylen = strlen(key);
+    object->keys[len] = (char *)malloc(keylen + 1);
+    strcpy(object->keys[len], key);
+    object->props[len].key = (char *)malloc(keylen + 1);
+    strcpy(object->props[len].key, key);
+
+    object->props[len].value.type = type;
+    void *value_ptr = NULL;
+    __JSON_VALUE_ON_TYPE(object->props[len].value, &value_ptr, type);
+    return value_ptr;
+}
+
+void * __json_set(json_value_t *value, const char *key,
+        const json_value_type_t type) {
+    if (JSON_EXISTS((*value), (char *)key)) {
+        // FIXME: mem leak! overridden objects are not getitng free'd
+        return __json_object_set_in_place(value->object, key, type);
+    }
+
+    return __json_object_add(&(value->object), key, type);
+}
+
+json_value_t __json_wrap_object_value(const json_value_t value) {
+    JSON_ASSERT(value.type == JSON_TYPE_OBJECT);
+    json_value_t new_value = value;
+
+    const u32 props_size
+        = sizeof(json_property_t) * new_value.object.len;
+    const u32 keys_size
+        = sizeof(char *) * new_value.object.len;
+    new_value.object.keys =
+        (char **)malloc(keys_size);
+
+    for (u32 i=0;
+            i<new_value.object.len;
+            i++) {
+        const u32 keylen = strlen(new_value.object.props[i].key);
+        new_value.object.keys[i] = (char *)malloc(keylen);
+        strcpy(new_value.object.keys[i], new_value.object.props[i].key);
+    }
+
+    new_value.object.__keys_cap = keys_size;
+    new_value.object.__props_cap = props_size;
+
+    return new_value;
+}
+
+
+static
+char *string_copy(const char *str) {
+    const u32 len = strlen(str);
+    char *copy = (char *)malloc(len + 1);
+    if (copy != NULL) {
+        memcpy(copy, str, len + 1);
+    }
+    return copy;
+}
+
+static
+json_value_t empty_object(void) {
+    json_value_t value;
+    memset(&value, 0, sizeof(json_value_t));
+    value.type = JSON_TYPE_OBJECT;
+    return value;
+}
+
+// Appends a property taking ownership of key and value
+static
+u32 object_append(json_object_t *object, char *key, const json_value_t value) {
+    const u32 len = object->len;
+    if ((len + 1) * sizeof(json_property_t) > object->__props_cap
+            || (len + 1) * sizeof(char *) > object->__keys_cap) {
+        const u32 cap = len < 4 ? 4 : len + len / 2;
+        json_property_t *props = (json_property_t *)realloc(object->props,
+                sizeof(json_property_t) * cap);
+        if (props == NULL) {
+            return JSON_ALLOC_FAILED_ERR;
+        }
+        object->props = props;
+        object->__props_cap = sizeof(json_property_t) * cap;
+
+        char **keys = (char **)realloc(object->keys, sizeof(char *) * cap);
+        if (keys == NULL) {
+            return JSON_ALLOC_FAILED_ERR;
+        }
+        object->keys = keys;
+        object->__keys_cap = sizeof(char *) * cap;
+    }
+
+    object->props[len].key = key;
+    object->props[len].value = value;
+    object->keys[len] = key;
+    object->len++;
+    return NONE;
+}
+
+// Detaches the key of a property, dropping the second copy JSON_SET makes
+static
+char *object_take_key(json_object_t *object, const u32 idx) {
+    if (object->keys[idx] != object->props[idx].key) {
+        free(object->keys[idx]);
+    }
+    object->keys[idx] = NULL;
+    return object->props[idx].key;
+}
+
+static
+void object_remove(json_object_t *object, const u32 idx) {
+    free(object_take_key(object, idx));
+    json_free(&(object->props[idx].value));
+
+    const u32 after = object->len - idx - 1;
+    memmove(&(object->props[idx]), &(object->props[idx + 1]),
+            sizeof(json_property_t) * after);
+    memmove(&(object->keys[idx]), &(object->keys[idx + 1]),
+            sizeof(char *) * after);
+    object->len--;
+}
+
+void * __json_set_path(json_value_t *value, const char **keys,
+        const u32 len, const json_value_type_t type) {
+    JSON_ASSERT(len > 0);
+
+    json_value_t *parent = value;
+    for (u32 k=0;
+            k<len;
+            k++) {
+        if (parent->type != JSON_TYPE_OBJECT) {
+            json_free(parent);
+            *parent = empty_object();
+        }
+
+        json_object_t *object = &(parent->object);
+        i64 idx = object_index(object, keys[k]);
+        if (idx < 0) {
+            json_value_t child = k + 1 < len ? empty_object() : JSON_NULL;
+            char *key = string_copy(keys[k]);
+            if (key == NULL || object_append(object, key, child)) {
+                free(key);
+                return NULL;
+            }
+            idx = object->len - 1;
+        } else if (k + 1 == len) {
+            json_free(&(object->props[idx].value));
+        }
+        parent = &(object->props[idx].value);
+    }
+
+    parent->type = type;
+    void *value_ptr = parent;
+    __JSON_VALUE_ON_TYPE((*parent), &value_ptr, type);
+    return value_ptr;
+}
+
+BOOL __json_delete_path(json_value_t *value, const char **keys,
+        const u32 len) {
+    json_value_t *parent = value;
+    for (u32 k=0;
+            k<len;
+            k++) {
+        if (parent->type != JSON_TYPE_OBJECT) {
+            return FALSE;
+        }
+        const i64 idx = object_index(&(parent->object), keys[k]);
+        if (idx < 0) {
+            return FALSE;
+        }
+        if (k + 1 == len) {
+            object_remove(&(parent->object), (u32)idx);
+            return TRUE;
+        }
+        parent = &(parent->object.props[idx].value);
+    }
+    return FALSE;
+}
+
+/*
+ * Index of `key` in `object`, trying `hint` first so members sharing a
+ * duplicate key pair up by position instead of all matching the first.
+ */
+static
+i64 object_match(const json_object_t *object, const char *key, const u32 hint) {
+    if (hint < object->len && !strcmp(object->props[hint].key, key)) {
+        return hint;
+    }
+    return object_index(object, key);
+}
+
+BOOL json_equal(const json_value_t *a, const json_value_t *b) {
+    if (a->type != b->type) {
+        return FALSE;
+    }
+
+    switch (a->type) {
+    case JSON_TYPE_NUMBER:
+        return a->number == b->number;
+    case JSON_TYPE_BOOL:
+        return a->boolean == b->boolean;
+    case JSON_TYPE_STRING:
+        return !strcmp(a->str, b->str);
+    case JSON_TYPE_ARRAY:
+        if (a->array.len != b->array.len) return FALSE;
+        for (u32 i=0; i<a->array.len; i++) {
+            if (!json_equal(&(a->array.values[i]), &(b->array.values[i]))) {
+                return FALSE;
+            }
+        }
+        return TRUE;
+    case JSON_TYPE_OBJECT:
+        if (a->object.len != b->object.len) return FALSE;
+        for (u32 i=0; i<a->object.len; i++) {
+            const i64 idx = object_match(&(b->object), a->object.props[i].key, i);
+            if (idx < 0 || !json_equal(&(a->object.props[i].value),
+                        &(b->object.props[idx].value))) {
+                return FALSE;
+            }
+        }
+        return TRUE;
+    default:
+        return TRUE;
+    }
+}
+
+static
+u32 value_copy(const json_value_t *src, json_value_t *dst) {
+    *dst = *src;
+
+    switch (src->type) {
+    case JSON_TYPE_STRING:
+        dst->str = string_copy(src->str);
+        return dst->str != NULL ? NONE : JSON_ALLOC_FAILED_ERR;
+    case JSON_TYPE_ARRAY: {
+        dst->array.values =
+            (json_value_t *)malloc(sizeof(json_value_t) * (src->array.len + 1));
+        dst->array.__cap = sizeof(json_value_t) * (src->array.len + 1);
+        dst->array.len = 0;
+        if (dst->array.values == NULL) {
+            dst->type = JSON_TYPE_NULL;
+            return JSON_ALLOC_FAILED_ERR;
+        }
+        for (u32 i=0; i<src->array.len; i++) {
+            const u32 err = value_copy(&(src->array.values[i]),
+                    &(dst->array.values[i]));
+            if (err) return err;
+            dst->array.len++;
+        }
+        return NONE;
+    }
+    case JSON_TYPE_OBJECT: {
+        *dst = empty_object();
+        for (u32 i=0; i<src->object.len; i++) {
+            json_value_t child;
+            u32 err = value_copy(&(src->object.props[i].value), &child);
+            char *key = string_copy(src->object.props[i].key);
+            if (!err && key == NULL) err = JSON_ALLOC_FAILED_ERR;
+            if (!err) err = object_append(&(dst->object), key, child);
+            if (err) {
+                free(key);
+                json_free(&child);
+                return err;
+            }
+        }
+        return NONE;
+    }
+    default:
+        return NONE;
+    }
+}
+
+/*
+ * RFC 7386 merge patch. The patch is consumed: its members are moved
+ * into the target rather than copied, and the patch is left null.
+ * Removed or replaced target members are released with json_free.
+ */
+u32 json_merge_patch(json_value_t *target, json_value_t *patch) {
+    if (patch->type != JSON_TYPE_OBJECT) {
+        json_free(target);
+        *target = *patch;
+        patch->type = JSON_TYPE_NULL;
+        return NONE;
+    }
+
+    if (target->type != JSON_TYPE_OBJECT) {
+        json_free(target);
+        *target = empty_object();
+    }
+
+    u32 err = NONE;
+    json_object_t *object = &(target->object);
+    for (u32 i=0;
+            i<patch->object.len;
+            i++) {
+        json_value_t *value = &(patch->object.props[i].value);
+        char *key = object_take_key(&(patch->object), i);
+        const i64 idx = object_index(object, key);
+
+        if (err || value->type == JSON_TYPE_NULL) {
+            if (!err && idx >= 0) {
+                object_remove(object, (u32)idx);
+            }
+            free(key);
+            json_free(value);
+        } else if (idx >= 0) {
+            free(key);
+            err = json_merge_patch(&(object->props[idx].value), value);
+        } else {
+            // Nested patches also drop their nulls when creating members
+            json_value_t created = JSON_NULL;
+            err = json_merge_patch(&created, value);
+            if (!err) err = object_append(object, key, created);
+            if (err) {
+                free(key);
+                json_free(&created);
+            }
+        }
+    }
+
+    free(patch->object.props);
+    free(patch->object.keys);
+    patch->type = JSON_TYPE_NULL;
+    return err;
+}
+
+/*
+ * Builds the merge patch turning `from` into `to`. Unchanged members are
+ * left out, only changed values are copied. Like any merge patch it
+ * can't express null members in `to`, those read as removals.
+ */
+u32 json_diff(const json_value_t *from, const json_value_t *to,
+        json_value_t *patch) {
+    if (from->type != JSON_TYPE_OBJECT || to->type != JSON_TYPE_OBJECT) {
+        return value_copy(to, patch);
+    }
+
+    *patch = empty_object();
+    u32 err = NONE;
+
+    for (u32 i=0; i<from->object.len && !err; i++) {
+        const char *key = from->object.props[i].key;
+        if (object_index(&(to->object), key) < 0) {
+            char *removed = string_copy(key);
+            err = removed != NULL
+                ? object_append(&(patch->object), removed, JSON_NULL)
+                : JSON_ALLOC_FAILED_ERR;
+        }
+    }
+
+    for (u32 i=0; i<to->object.len && !err; i++) {
+        const json_property_t *prop = &(to->object.props[i]);
+        const i64 idx = object_match(&(from->object), prop->key, i);
+        const json_value_t *old = idx >= 0 ? &(from->object.props[idx].value) : NULL;
+
+        json_value_t change;
+        if (old != NULL && old->type == JSON_TYPE_OBJECT
+                && prop->value.type == JSON_TYPE_OBJECT) {
+            err = json_diff(old, &(prop->value), &change);
+            if (!err && change.object.len == 0) {
+                json_free(&change);
+                continue;
+            }
+        } else if (old != NULL && json_equal(old, &(prop->value))) {
+            continue;
+        } else {
+            err = value_copy(&(prop->value), &change);
+        }
+
+        char *key = err ? NULL : string_copy(prop->key);
+        if (!err && key == NULL) err = JSON_ALLOC_FAILED_ERR;
+        if (!err) err = object_append(&(patch->object), key, change);
+        if (err) {
+            free(key);
+            json_free(&change);
+        }
+    }
+
+    return err;
+}
+
+#define SNAPSHOT_ALIGN(SIZE) (((SIZE) + 7) & ~(u64)7)
+
+static
+u64 snapshot_payload_size(const json_value_t *value) {
+    u64 size = 0;
+    switch (value->type) {
+    case JSON_TYPE_STRING:
+        return SNAPSHOT_ALIGN(strlen(value->str) + 1);
+    case JSON_TYPE_ARRAY:
+        size = sizeof(json_snapshot_node_t) * (u64)value->array.len;
+        for (u32 i=0; i<value->array.len; i++) {
+            size += snapshot_payload_size(&(value->array.values[i]));
+        }
+        return size;
+    case JSON_TYPE_OBJECT:
+        size = sizeof(json_snapshot_prop_t) * (u64)value->object.len;
+        for (u32 i=0; i<value->object.len; i++) {
+            size += SNAPSHOT_ALIGN(strlen(value->object.props[i].key) + 1);
+            size += snapshot_payload_size(&(value->object.props[i].value));
+        }
+        return size;
+    default:
+        return 0;
+    }
+}
+
+static
+u64 snapshot_write_string(u8 *data, u64 *pos, const char *str) {
+    const u64 offset = *pos;
+    const u64 len = strlen(str) + 1;
+    memcpy(&(data[offset]), str, len);
+    *pos += SNAPSHOT_ALIGN(len);
+    return offset;
+}
+
+// data is pre-sized, nodes can be filled through pointers into it
+static
+void snapshot_write_value(u8 *data, u64 *pos, const json_value_t *value,
+        json_snapshot_node_t *node) {
+    node->type = value->type;
+    node->len = 0;
+    node->offset = 0;
+
+    switch (value->type) {
+    case JSON_TYPE_NUMBER:
+        node->number = value->number;
+        break;
+    case JSON_TYPE_BOOL:
+        node->boolean = value->boolean;
+        break;
+    case JSON_TYPE_STRING:
+        node->len = strlen(value->str);
+        node->offset = snapshot_write_string(data, pos, value->str);
+        break;
+    case JSON_TYPE_ARRAY: {
+        node->len = value->array.len;
+        node->offset = *pos;
+        json_snapshot_node_t *nodes = (json_snapshot_node_t *)&(data[*pos]);
+        *pos += sizeof(json_snapshot_node_t) * (u64)node->len;
+        for (u32 i=0; i<node->len; i++) {
+            snapshot_write_value(data, pos, &(value->array.values[i]),
+                    &(nodes[i]));
+        }
+        break;
+    }
+    case JSON_TYPE_OBJECT: {
+        node->len = value->object.len;
+        node->offset = *pos;
+        json_snapshot_prop_t *props = (json_snapshot_prop_t *)&(data[*pos]);
+        *pos += sizeof(json_snapshot_prop_t) * (u64)node->len;
+        for (u32 i=0; i<node->len; i++) {
+            props[i].key = snapshot_write_string(data, pos,
+                    value->object.props[i].key);
+            snapshot_write_value(data, pos, &(value->object.props[i].value),
+                    &(props[i].value));
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+// FNV-1a over 64 bit words, snapshots are always a multiple of 8 bytes
+static
+u64 snapshot_checksum(const u8 *data, const u64 size) {
+    u64 hash = 0xcbf29ce484222325ULL;
+    for (u64 i=0; i<size; i+=8) {
+        u64 word;
+        memcpy(&word, &(data[i]), 8);
+        hash ^= word;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Whether `count` records of `record` bytes at offset fit in the file
+static inline
+BOOL snapshot_record_in_bounds(const u64 size, const u64 offset,
+        const u64 count, const u64 record) {
+    if (record > 1 && (offset & 7)) {
+        return FALSE;
+    }
+    return offset >= sizeof(json_snapshot_header_t) && offset <= size
+        && count * record <= size - offset;
+}
+
+/*
+ * Offsets come straight from the file, nodes and payloads are checked
+ * against the mapping before a handle to them is made.
+ */
+static
+json_snapshot_value_t snapshot_value(const u8 *base, const u64 size,
+        const json_snapshot_node_t *node) {
+    json_snapshot_value_t value;
+    value.type = JSON_TYPE_NONE;
+    value.__base = base;
+    value.__size = size;
+    value.__node = NULL;
+    if (node == NULL) {
+        return value;
+    }
+
+    BOOL in_bounds;
+    switch (node->type) {
+    case JSON_TYPE_NUMBER:
+    case JSON_TYPE_BOOL:
+    case JSON_TYPE_NULL:
+        in_bounds = TRUE;
+        break;
+    case JSON_TYPE_STRING:
+        in_bounds = snapshot_record_in_bounds(size, node->offset,
+                (u64)node->len + 1, 1);
+        break;
+    case JSON_TYPE_ARRAY:
+        in_bounds = snapshot_record_in_bounds(size, node->offset,
+                node->len, sizeof(json_snapshot_node_t));
+        break;
+    case JSON_TYPE_OBJECT:
+        in_bounds = snapshot_record_in_bounds(size, node->offset,
+                node->len, sizeof(json_snapshot_prop_t));
+        break;
+    default:
+        in_bounds = FALSE;
+        break;
+    }
+
+    if (in_bounds) {
+        value.type = (json_value_type_t)node->type;
+        value.__node = node;
+    }
+    return value;
+}
+
+u32 json_snapshot_dump(const json_value_t *value, void **data, u64 *size) {
+    JSON_ASSERT(value != NULL && data != NULL && size != NULL);
+
+    // The zero trailer ends any string read from a corrupt offset
+    const u64 body = sizeof(json_snapshot_node_t) + snapshot_payload_size(value)
+        + 8;
+    const u64 total = sizeof(json_snapshot_header_t) + body;
+    u8 *buffer = (u8 *)calloc(1, total);
+    if (buffer == NULL) {
+        return JSON_ALLOC_FAILED_ERR;
+    }
+
+    json_snapshot_header_t *header = (json_snapshot_header_t *)buffer;
+    u64 pos = sizeof(json_snapshot_header_t);
+    json_snapshot_node_t *root = (json_snapshot_node_t *)&(buffer[pos]);
+    header->root = pos;
+    pos += sizeof(json_snapshot_node_t);
+    snapshot_write_value(buffer, &pos, value, root);
+    JSON_ASSERT(pos + 8 == total);
+
+    header->magic = JSON_SNAPSHOT_MAGIC;
+    header->version = JSON_SNAPSHOT_VERSION;
+    header->byte_order = JSON_SNAPSHOT_BYTE_ORDER;
+    header->double_size = sizeof(double);
+    header->size = total;
+    header->checksum = snapshot_checksum(
+            &(buffer[sizeof(json_snapshot_header_t)]), body);
+
+    *data = buffer;
+    *size = total;
+    return NONE;
+}
+
+u32 json_snapshot_write(const json_value_t *value, const char *path) {
+    void *data;
+    u64 size;
+    u32 err = json_snapshot_dump(value, &data, &size);
+    if (err) {
+        return err;
+    }
+
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        free(data);
+        return JSON_FOPEN_ERR;
+    }
+    if (fwrite(data, 1, size, file) != size) {
+        err = JSON_FOPEN_ERR;
+    }
+    if (fclose(file)) {
+        err = JSON_FOPEN_ERR;
+    }
+    free(data);
+    return err;
+}
+
+u32 json_snapshot_load(json_snapshot_t *snapshot, const void *data,
+        const u64 size, const BOOL verify) {
+    JSON_ASSERT(snapshot != NULL);
+    memset(snapshot, 0, sizeof(json_snapshot_t));
+
+    const json_snapshot_header_t *header = (const json_snapshot_header_t *)data;
+    const u8 *base = (const u8 *)data;
+    if (size < sizeof(json_snapshot_header_t) + sizeof(json_snapshot_node_t) + 8
+            || ((uintptr_t)data & 7)
+            || header->magic != JSON_SNAPSHOT_MAGIC
+            || header->version != JSON_SNAPSHOT_VERSION
+            || header->byte_order != JSON_SNAPSHOT_BYTE_ORDER
+            || header->double_size != sizeof(double)
+            || header->size != size
+            || base[size - 1] != 0
+            || !snapshot_record_in_bounds(size, header->root,
+                1, sizeof(json_snapshot_node_t))) {
+        return JSON_SNAPSHOT_ERR;
+    }
+
+    if (verify && header->checksum != snapshot_checksum(
+                &(base[sizeof(json_snapshot_header_t)]),
+                size - sizeof(json_snapshot_header_t))) {
+        return JSON_SNAPSHOT_ERR;
+    }
+
+    const json_snapshot_node_t *root =
+        (const json_snapshot_node_t *)&(base[header->root]);
+    snapshot->root = snapshot_value(base, size, root);
+    if (snapshot->root.type == JSON_TYPE_NONE) {
+        return JSON_SNAPSHOT_ERR;
+    }
+    snapshot->size = size;
+    snapshot->__data = base;
+    return NONE;
+}
+
+u32 json_snapshot_open(json_snapshot_t *snapshot, const char *path,
+        const BOOL verify) {
+#ifdef JSON_MMAP
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return JSON_FOPEN_ERR;
+    }
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size == 0) {
+        close(fd);
+        return JSON_FOPEN_ERR;
+    }
+    // Read-only shared pages, processes loading the same file share them
+    void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return JSON_FOPEN_ERR;
+    }
+
+    const u32 err = json_snapshot_load(snapshot, data, (u64)st.st_size, verify);
+    if (err) {
+        munmap(data, (size_t)st.st_size);
+        return err;
+    }
+    snapshot->__owned = TRUE;
+    return NONE;
+#else
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return JSON_FOPEN_ERR;
+    }
+    fseek(file, 0, SEEK_END);
+    const long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    void *data = size > 0 ? malloc((size_t)size) : NULL;
+    if (data == NULL || fread(data, 1, (size_t)size, file) != (size_t)size) {
+        free(data);
+        fclose(file);
+        return JSON_FOPEN_ERR;
+    }
+    fclose(file);
+
+    const u32 err = json_snapshot_load(snapshot, data, (u64)size, verify);
+    if (err) {
+        free(data);
+        return err;
+    }
+    snapshot->__owned = TRUE;
+    return NONE;
+#endif
+}
+
+void json_snapshot_close(json_snapshot_t *snapshot) {
+    if (snapshot->__owned) {
+#ifdef JSON_MMAP
+        munmap((void *)snapshot->__data, (size_t)snapshot->size);
+#else
+        free((void *)snapshot->__data);
+#endif
+    }
+    memset(snapshot, 0, sizeof(json_snapshot_t));
+}
+
+json_snapshot_value_t __json_snapshot_object_get(
+        const json_snapshot_value_t value, const char **keys, const u32 len) {
+    const json_snapshot_node_t *node = value.__node;
+
+    for (u32 k=0;
+            k<len && node != NULL;
+            k++) {
+        if (node->type != JSON_TYPE_OBJECT) {
+            return snapshot_value(value.__base, value.__size, NULL);
+        }
+
+        const json_snapshot_prop_t *props =
+            (const json_snapshot_prop_t *)&(value.__base[node->offset]);
+        const u32 props_len = node->len;
+        node = NULL;
+        for (u32 i=0;
+                i<props_len;
+                i++) {
+            // The zero trailer stops reads from any key inside the file
+            if (props[i].key >= value.__size) {
+                continue;
+            }
+            if (!strcmp((const char *)&(value.__base[props[i].key]), keys[k])) {
+                const json_snapshot_value_t found = snapshot_value(
+                        value.__base, value.__size, &(props[i].value));
+                node = found.__node;
+                break;
+            }
+        }
+    }
+
+    return snapshot_value(value.__base, value.__size, node);
+}
+
+json_snapshot_value_t __json_snapshot_array_get(
+        const json_snapshot_value_t value, const u32 idx) {
+    if (idx >= value.__node->len) {
+        return snapshot_value(value.__base, value.__size, NULL);
+    }
+    const json_snapshot_node_t *nodes =
+        (const json_snapshot_node_t *)&(value.__base[value.__node->offset]);
+    return snapshot_value(value.__base, value.__size, &(nodes[idx]));
+}
+
+typedef struct {
+    const char **paths;
+    u32 count;
+    json_batch_callback_t callback;
+    void *user;
+    u32 next;
+    // Paths the ring gave up on, read before paths[resume..count)
+    u32 *retry;
+    u32 retry_len;
+    u32 resume;
+#ifdef JSON_THREADS
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+#endif
+} batch_t;
+
+static
+void batch_parse(const batch_t *batch, const u32 idx, const char *text,
+        const u32 len) {
+    json_value_t value;
+    const u32 err = json_parse(&value, text, len);
+    batch->callback(batch->user, idx, err, err ? NULL : &value);
+}
+
+// Reads a whole file into a reused, NUL terminated buffer
+static
+u32 read_file(const char *path, char **buffer, u32 *cap, u32 *len) {
+#ifdef JSON_MMAP
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return JSON_FOPEN_ERR;
+    }
+    struct stat st;
+    if (fstat(fd, &st)) {
+        close(fd);
+        return JSON_FOPEN_ERR;
+    }
+    if (st.st_size <= 0 || st.st_size >= (off_t)UINT32_MAX) {
+        close(fd);
+        return st.st_size == 0 ? JSON_LEN_MISMATCH_ERR : JSON_FOPEN_ERR;
+    }
+    const u32 size = (u32)st.st_size;
+#else
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return JSON_FOPEN_ERR;
+    }
+    fseek(file, 0, SEEK_END);
+    const long file_size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (file_size <= 0) {
+        fclose(file);
+        return JSON_LEN_MISMATCH_ERR;
+    }
+    const u32 size = (u32)file_size;
+#endif
+
+    if (size + 1 > *cap) {
+        char *new_buffer = (char *)realloc(*buffer, size + 1);
+        if (new_buffer == NULL) {
+#ifdef JSON_MMAP
+            close(fd);
+#else
+            fclose(file);
+#endif
+            return JSON_ALLOC_FAILED_ERR;
+        }
+        *buffer = new_buffer;
+        *cap = size + 1;
+    }
+
+    u32 read = 0;
+#ifdef JSON_MMAP
+    while (read < size) {
+        const ssize_t n = pread(fd, &((*buffer)[read]), size - read, read);
+        if (n <= 0) break;
+        read += (u32)n;
+    }
+    close(fd);
+#else
+    read = (u32)fread(*buffer, 1, size, file);
+    fclose(file);
+#endif
+    if (read != size) {
+        return JSON_LEN_MISMATCH_ERR;
+    }
+
+    (*buffer)[size] = 0;
+    *len = size;
+    return NONE;
+}
+
+// Maps the next ticket to a path index, retried paths come first
+static
+u32 batch_claim(batch_t *batch) {
+#ifdef JSON_THREADS
+    const u32 ticket = __atomic_fetch_add(&(batch->next), 1, __ATOMIC_RELAXED);
+#else
+    const u32 ticket = batch->next++;
+#endif
+    if (ticket < batch->retry_len) {
+        return batch->retry[ticket];
+    }
+    return batch->resume + (ticket - batch->retry_len);
+}
+
+// Fallback: every worker reads a file into its own buffer and parses it
+static
+void *batch_read_worker(void *arg) {
+    batch_t *batch = (batch_t *)arg;
+    char *buffer = NULL;
+    u32 cap = 0;
+
+    for (;;) {
+        const u32 idx = batch_claim(batch);
+        if (idx >= batch->count) {
+            break;
+        }
+
+        u32 len;
+        const u32 err = read_file(batch->paths[idx], &buffer, &cap, &len);
+        if (err) {
+            batch->callback(batch->user, idx, err, NULL);
+            continue;
         }
+        batch_parse(batch, idx, buffer, len);
     }
+
+    free(buffer);
     return NULL;
 }
 
-void * __json_object_add(json_object_t *object, const char *key,
-        const json_value_type_t type) {
-    // Check for any room left in mem
-    if ((object->len + 1) * sizeof(json_property_t) >= object->__props_cap) {
-        object->__props_cap += object->__props_cap / 2;
-        object->props = realloc(object->props, object->__props_cap);
-        JSON_ASSERT(object->props != NULL); // FIXME: return error to the caller
+#ifdef JSON_IO_URING
+
+#define BATCH_NO_SLOT ((u32)-1)
+
+typedef struct {
+    char *buffer;
+    u32 cap;
+    u32 size;
+    u32 read;
+    u32 path;
+    int fd;
+    struct iovec iov;
+} batch_slot_t;
+
+typedef struct {
+    int fd;
+    u32 *sq_head;
+    u32 *sq_tail;
+    u32 *sq_mask;
+    u32 *sq_array;
+    u32 *cq_head;
+    u32 *cq_tail;
+    u32 *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr;
+    void *cq_ptr;
+    size_t sq_size;
+    size_t cq_size;
+    size_t sqes_size;
+} batch_ring_t;
+
+typedef struct {
+    batch_t *batch;
+    batch_slot_t *slots;
+    // Slots go free -> reading -> ready -> parsing -> free
+    u32 *free_slots;
+    u32 free_len;
+    u32 *ready;
+    u32 ready_head;
+    u32 ready_len;
+    u32 depth;
+    BOOL done;
+} batch_uring_t;
+
+static
+void ring_close(batch_ring_t *ring) {
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ptr != NULL && ring->cq_ptr != MAP_FAILED
+            && ring->cq_ptr != ring->sq_ptr)
+        munmap(ring->cq_ptr, ring->cq_size);
+    if (ring->sq_ptr != NULL && ring->sq_ptr != MAP_FAILED)
+        munmap(ring->sq_ptr, ring->sq_size);
+    if (ring->fd >= 0)
+        close(ring->fd);
+}
+
+static
+u32 ring_setup(batch_ring_t *ring, const u32 entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(batch_ring_t));
+
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        return JSON_FOPEN_ERR;
     }
-    if ((object->len + 1) * sizeof(char) >= object->__keys_cap) {
-        object->__keys_cap += object->__keys_cap / 2;
-        object->keys = realloc(object->keys, object->__keys_cap);
-        JSON_ASSERT(object->keys != NULL); // FIXME: return error to the caller
+
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(u32);
+    ring->cq_size = params.cq_off.cqes
+        + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_size > ring->sq_size) ring->sq_size = ring->cq_size;
+        ring->cq_size = ring->sq_size;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ptr = (params.features & IORING_FEAT_SINGLE_MMAP)
+        ? ring->sq_ptr
+        : mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqes_size,
+            PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ptr == MAP_FAILED || ring->cq_ptr == MAP_FAILED
+            || ring->sqes == MAP_FAILED) {
+        ring_close(ring);
+        return JSON_FOPEN_ERR;
     }
 
-    const u32 len = object->len;
-    object->len++;
-    const u32 keylen = strlen(key);
-    object->keys[len] = (char *)malloc(keylen + 1);
-    strcpy(object->keys[len], key);
-    object->props[len].key = (char *)malloc(keylen + 1);
-    strcpy(object->props[len].key, key);
+    u8 *sq = (u8 *)ring->sq_ptr;
+    u8 *cq = (u8 *)ring->cq_ptr;
+    ring->sq_head = (u32 *)&(sq[params.sq_off.head]);
+    ring->sq_tail = (u32 *)&(sq[params.sq_off.tail]);
+    ring->sq_mask = (u32 *)&(sq[params.sq_off.ring_mask]);
+    ring->sq_array = (u32 *)&(sq[params.sq_off.array]);
+    ring->cq_head = (u32 *)&(cq[params.cq_off.head]);
+    ring->cq_tail = (u32 *)&(cq[params.cq_off.tail]);
+    ring->cq_mask = (u32 *)&(cq[params.cq_off.ring_mask]);
+    ring->cqes = (struct io_uring_cqe *)&(cq[params.cq_off.cqes]);
+    return NONE;
+}
 
-    object->props[len].value.type = type;
-    void *value_ptr = NULL;
-    __JSON_VALUE_ON_TYPE(object->props[len].value, &value_ptr, type);
-    return value_ptr;
+static
+void ring_prep_readv(batch_ring_t *ring, batch_slot_t *slot, const u32 idx) {
+    const u32 tail = *(ring->sq_tail);
+    const u32 at = tail & *(ring->sq_mask);
+    struct io_uring_sqe *sqe = &(ring->sqes[at]);
+
+    slot->iov.iov_base = &(slot->buffer[slot->read]);
+    slot->iov.iov_len = slot->size - slot->read;
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = slot->fd;
+    sqe->addr = (u64)(uintptr_t)&(slot->iov);
+    sqe->len = 1;
+    sqe->off = slot->read;
+    sqe->user_data = idx;
+
+    ring->sq_array[at] = at;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
 }
 
-void * __json_set(json_value_t *value, const char *key,
-        const json_value_type_t type) {
-    if (JSON_EXISTS((*value), (char *)key)) {
-        // FIXME: mem leak! overridden objects are not getitng free'd
-        return __json_object_set_in_place(value->object, key, type);
+static
+i32 ring_enter(batch_ring_t *ring, u32 to_submit) {
+    for (;;) {
+        const long n = syscall(__NR_io_uring_enter, ring->fd, to_submit, 1,
+                IORING_ENTER_GETEVENTS, NULL, 0);
+        if (n >= 0 && (u32)n >= to_submit) {
+            return 0;
+        }
+        if (n >= 0) {
+            to_submit -= (u32)n;
+        } else if (errno != EINTR && errno != EAGAIN) {
+            return -1;
+        }
     }
+}
 
-    return __json_object_add(&(value->object), key, type);
+static
+void uring_release(batch_uring_t *uring, const u32 slot) {
+    pthread_mutex_lock(&(uring->batch->lock));
+    uring->free_slots[uring->free_len++] = slot;
+    pthread_cond_broadcast(&(uring->batch->cond));
+    pthread_mutex_unlock(&(uring->batch->lock));
 }
 
-json_value_t __json_wrap_object_value(const json_value_t value) {
-    JSON_ASSERT(value.type == JSON_TYPE_OBJECT);
-    json_value_t new_value = value;
+static
+u32 uring_acquire(batch_uring_t *uring, const BOOL wait) {
+    u32 slot = BATCH_NO_SLOT;
+    pthread_mutex_lock(&(uring->batch->lock));
+    while (wait && uring->free_len == 0) {
+        pthread_cond_wait(&(uring->batch->cond), &(uring->batch->lock));
+    }
+    if (uring->free_len) {
+        slot = uring->free_slots[--uring->free_len];
+    }
+    pthread_mutex_unlock(&(uring->batch->lock));
+    return slot;
+}
 
-    const u32 props_size
-        = sizeof(json_property_t) * new_value.object.len;
-    const u32 keys_size
-        = sizeof(char *) * new_value.object.len;
-    new_value.object.keys =
-        (char **)malloc(keys_size);
+static
+void *batch_parse_worker(void *arg) {
+    batch_uring_t *uring = (batch_uring_t *)arg;
+    batch_t *batch = uring->batch;
+
+    for (;;) {
+        pthread_mutex_lock(&(batch->lock));
+        while (uring->ready_len == 0 && !uring->done) {
+            pthread_cond_wait(&(batch->cond), &(batch->lock));
+        }
+        if (uring->ready_len == 0) {
+            pthread_mutex_unlock(&(batch->lock));
+            break;
+        }
+        const u32 slot = uring->ready[uring->ready_head];
+        uring->ready_head = (uring->ready_head + 1) % uring->depth;
+        uring->ready_len--;
+        pthread_mutex_unlock(&(batch->lock));
+
+        batch_slot_t *s = &(uring->slots[slot]);
+        batch_parse(batch, s->path, s->buffer, s->size);
+        uring_release(uring, slot);
+    }
 
-    for (u32 i=0;
-            i<new_value.object.len;
-            i++) {
-        const u32 keylen = strlen(new_value.object.props[i].key);
-        new_value.object.keys[i] = (char *)malloc(keylen);
-        strcpy(new_value.object.keys[i], new_value.object.props[i].key);
+    return NULL;
+}
+
+// Hands a read the ring won't finish to the pread fallback
+static
+void uring_retry(batch_uring_t *uring, const u32 slot) {
+    batch_slot_t *s = &(uring->slots[slot]);
+    close(s->fd);
+    uring->batch->retry[uring->batch->retry_len++] = s->path;
+    uring_release(uring, slot);
+}
+
+// Takes back the entries the kernel hasn't consumed, returns how many
+static
+u32 ring_unqueue(batch_ring_t *ring, batch_uring_t *uring) {
+    const u32 head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    const u32 tail = *(ring->sq_tail);
+    for (u32 at=head; at!=tail; at++) {
+        const u32 sqe = ring->sq_array[at & *(ring->sq_mask)];
+        uring_retry(uring, (u32)ring->sqes[sqe].user_data);
     }
+    __atomic_store_n(ring->sq_tail, head, __ATOMIC_RELEASE);
+    return tail - head;
+}
 
-    new_value.object.__keys_cap = keys_size;
-    new_value.object.__props_cap = props_size;
+/*
+ * Handles the completions posted so far and returns how many reads are
+ * done. Short reads are queued again, counted in `queued`, or handed to
+ * the fallback when `queued` is NULL.
+ */
+static
+u32 uring_reap(batch_ring_t *ring, batch_uring_t *uring, u32 *queued) {
+    batch_t *batch = uring->batch;
+    u32 done = 0;
+
+    u32 head = *(ring->cq_head);
+    const u32 tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        const struct io_uring_cqe *cqe = &(ring->cqes[head & *(ring->cq_mask)]);
+        const u32 slot = (u32)cqe->user_data;
+        batch_slot_t *s = &(uring->slots[slot]);
+
+        if (cqe->res > 0 && s->read + (u32)cqe->res < s->size) {
+            s->read += (u32)cqe->res;
+            if (queued == NULL) {
+                uring_retry(uring, slot);
+                done++;
+                continue;
+            }
+            // Short read, queue the rest
+            ring_prep_readv(ring, s, slot);
+            (*queued)++;
+            continue;
+        }
 
-    return new_value;
+        done++;
+        close(s->fd);
+        if (cqe->res <= 0) {
+            batch->callback(batch->user, s->path,
+                    cqe->res < 0 ? JSON_FOPEN_ERR : JSON_LEN_MISMATCH_ERR,
+                    NULL);
+            uring_release(uring, slot);
+            continue;
+        }
+
+        s->buffer[s->size] = 0;
+        pthread_mutex_lock(&(batch->lock));
+        uring->ready[(uring->ready_head + uring->ready_len) % uring->depth] = slot;
+        uring->ready_len++;
+        pthread_cond_broadcast(&(batch->cond));
+        pthread_mutex_unlock(&(batch->lock));
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    return done;
+}
+
+// Opens the file and sizes the slot buffer, the read itself goes to the ring
+static
+u32 slot_open(batch_slot_t *slot, const char *path) {
+    slot->fd = open(path, O_RDONLY);
+    if (slot->fd < 0) {
+        return JSON_FOPEN_ERR;
+    }
+    struct stat st;
+    u32 err = NONE;
+    if (fstat(slot->fd, &st)) {
+        err = JSON_FOPEN_ERR;
+    } else if (st.st_size >= (off_t)UINT32_MAX) {
+        err = JSON_FOPEN_ERR;
+    } else if (st.st_size == 0) {
+        err = JSON_LEN_MISMATCH_ERR;
+    } else if ((u32)st.st_size + 1 > slot->cap) {
+        char *buffer = (char *)realloc(slot->buffer, (u32)st.st_size + 1);
+        if (buffer == NULL) {
+            err = JSON_ALLOC_FAILED_ERR;
+        } else {
+            slot->buffer = buffer;
+            slot->cap = (u32)st.st_size + 1;
+        }
+    }
+    if (err) {
+        close(slot->fd);
+        return err;
+    }
+    slot->size = (u32)st.st_size;
+    slot->read = 0;
+    return NONE;
+}
+
+/*
+ * The calling thread keeps up to `depth` reads in flight on the ring while
+ * workers parse completed files. Returns JSON_FOPEN_ERR when io_uring is
+ * unavailable or stops submitting, the paths it didn't finish are then
+ * left in batch->retry and batch->resume for the fallback.
+ */
+static
+u32 batch_run_uring(batch_t *batch, const u32 threads) {
+    batch_ring_t ring;
+    const u32 depth = threads * 2;
+    if (ring_setup(&ring, depth)) {
+        return JSON_FOPEN_ERR;
+    }
+
+    batch_uring_t uring;
+    memset(&uring, 0, sizeof(batch_uring_t));
+    uring.batch = batch;
+    uring.depth = depth;
+    uring.slots = (batch_slot_t *)calloc(depth, sizeof(batch_slot_t));
+    uring.free_slots = (u32 *)malloc(sizeof(u32) * depth);
+    uring.ready = (u32 *)malloc(sizeof(u32) * depth);
+    batch->retry = (u32 *)malloc(sizeof(u32) * depth);
+    pthread_t *workers = (pthread_t *)malloc(sizeof(pthread_t) * threads);
+    if (uring.slots == NULL || uring.free_slots == NULL
+            || uring.ready == NULL || batch->retry == NULL || workers == NULL) {
+        free(uring.slots); free(uring.free_slots); free(uring.ready);
+        free(batch->retry); free(workers);
+        batch->retry = NULL;
+        ring_close(&ring);
+        return JSON_ALLOC_FAILED_ERR;
+    }
+    for (u32 i=0; i<depth; i++) {
+        uring.free_slots[uring.free_len++] = depth - 1 - i;
+    }
+
+    u32 spawned = 0;
+    for (; spawned<threads; spawned++) {
+        if (pthread_create(&(workers[spawned]), NULL,
+                    batch_parse_worker, &uring)) {
+            break;
+        }
+    }
+
+    u32 err = spawned ? NONE : JSON_ALLOC_FAILED_ERR;
+    u32 inflight = 0;
+    u32 queued = 0;
+    while (!err) {
+        // Only block for a slot when nothing is in flight to wait on
+        while (batch->next < batch->count) {
+            const u32 slot = uring_acquire(&uring, inflight == 0 && queued == 0);
+            if (slot == BATCH_NO_SLOT) {
+                break;
+            }
+            batch_slot_t *s = &(uring.slots[slot]);
+            s->path = batch->next++;
+            const u32 open_err = slot_open(s, batch->paths[s->path]);
+            if (open_err) {
+                batch->callback(batch->user, s->path, open_err, NULL);
+                uring_release(&uring, slot);
+                continue;
+            }
+            ring_prep_readv(&ring, s, slot);
+            queued++;
+            inflight++;
+        }
+
+        if (inflight == 0) {
+            break;
+        }
+        if (ring_enter(&ring, queued)) {
+            err = JSON_FOPEN_ERR;
+            break;
+        }
+        queued = 0;
+        inflight -= uring_reap(&ring, &uring, &queued);
+    }
+
+    if (err == JSON_FOPEN_ERR) {
+        // Reads the kernel already took still own their buffers, wait them out
+        inflight -= ring_unqueue(&ring, &uring);
+        while (inflight) {
+            inflight -= uring_reap(&ring, &uring, NULL);
+            if (inflight && ring_enter(&ring, 0)) {
+                sched_yield();
+            }
+        }
+        batch->resume = batch->next;
+        batch->next = 0;
+    }
+
+    pthread_mutex_lock(&(batch->lock));
+    uring.done = TRUE;
+    pthread_cond_broadcast(&(batch->cond));
+    pthread_mutex_unlock(&(batch->lock));
+    for (u32 i=0; i<spawned; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    for (u32 i=0; i<depth; i++) {
+        free(uring.slots[i].buffer);
+    }
+    free(uring.slots);
+    free(uring.free_slots);
+    free(uring.ready);
+    free(workers);
+    ring_close(&ring);
+    return err;
 }
 
+#endif
+
+u32 json_batch_load(const char **paths, const u32 count, u32 threads,
+        json_batch_callback_t callback, void *user) {
+    JSON_ASSERT(callback != NULL);
+
+    batch_t batch;
+    memset(&batch, 0, sizeof(batch_t));
+    batch.paths = paths;
+    batch.count = count;
+    batch.callback = callback;
+    batch.user = user;
+
+#ifdef JSON_THREADS
+    if (threads == 0) {
+        const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (u32)cpus : 1;
+    }
+    if (threads > count) {
+        threads = count ? count : 1;
+    }
+
+    pthread_mutex_init(&(batch.lock), NULL);
+    pthread_cond_init(&(batch.cond), NULL);
+
+    u32 err = JSON_FOPEN_ERR;
+#ifdef JSON_IO_URING
+    err = batch_run_uring(&batch, threads);
+#endif
+    if (err == JSON_FOPEN_ERR) {
+        err = NONE;
+        pthread_t *workers = (pthread_t *)malloc(sizeof(pthread_t) * threads);
+        u32 spawned = 0;
+        if (workers != NULL) {
+            for (; spawned<threads; spawned++) {
+                if (pthread_create(&(workers[spawned]), NULL,
+                            batch_read_worker, &batch)) {
+                    break;
+                }
+            }
+        }
+        // Whatever is left is read on the calling thread
+        batch_read_worker(&batch);
+        for (u32 i=0; i<spawned; i++) {
+            pthread_join(workers[i], NULL);
+        }
+        free(workers);
+    }
+
+    free(batch.retry);
+    pthread_cond_destroy(&(batch.cond));
+    pthread_mutex_destroy(&(batch.lock));
+    return err;
+#else
+    (void)threads;
+    batch_read_worker(&batch);
+    return NONE;
+#endif
+}
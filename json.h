@@ -28,6 +28,17 @@ typedef int64_t i64;
 #define JSON_LEN_MISMATCH_ERR 0x1
 #define JSON_ALLOC_FAILED_ERR 0x2
 #define JSON_FOPEN_ERR        0x3
+#define JSON_SINK_ERR         0x4
+#define JSON_UNBALANCED_ERR   0x5
+#define JSON_SNAPSHOT_ERR     0x6
+#define JSON_PARSE_ERR        0x7
+
+#define JSON_SNAPSHOT_MAGIC   0x534e534a
+#define JSON_SNAPSHOT_VERSION 2
+#define JSON_SNAPSHOT_BYTE_ORDER 0x01020304
+
+#define JSON_TRANSCODE_BUF_SIZE  4096
+#define JSON_TRANSCODE_MAX_DEPTH 64
 
 #ifdef JSON_NO_ASSERT
 #define JSON_ASSERT(_) NONE
@@ -51,10 +62,10 @@ typedef int64_t i64;
         __VALUE.array.len)
 
 #define JSON_EXISTS(__VALUE, ...) \
-    (JSON_ASSERT(__VALUE.type == JSON_TYPE_OBJECT), \
+    ((JSON_ASSERT(__VALUE.type == JSON_TYPE_OBJECT), \
      __json_object_get_raw(__VALUE.object,\
          (const char **)((char *[]){ __VA_ARGS__ }),\
-         sizeof((char *[]){ __VA_ARGS__ })/sizeof(char *))) != NULL
+         sizeof((char *[]){ __VA_ARGS__ })/sizeof(char *))) != NULL)
 
 #define JSON_TYPE(__VALUE, __KEY) \
     (JSON_ASSERT(__VALUE.type == JSON_TYPE_OBJECT), \
@@ -68,6 +79,22 @@ typedef int64_t i64;
         *value_ptr = VALUE;\
     }while(0)
 
+#define JSON_SET_IN(__VALUE, __TYPE, TYPE, VALUE, ...) \
+    do{\
+        JSON_ASSERT(__VALUE.type == JSON_TYPE_OBJECT);\
+        TYPE *value_ptr = \
+            (TYPE *)__json_set_path(&(__VALUE),\
+                (const char **)((char *[]){ __VA_ARGS__ }),\
+                sizeof((char *[]){ __VA_ARGS__ })/sizeof(char *), __TYPE);\
+        *value_ptr = VALUE;\
+    }while(0)
+
+#define JSON_DELETE(__VALUE, ...) \
+    (JSON_ASSERT(__VALUE.type == JSON_TYPE_OBJECT), \
+     __json_delete_path(&(__VALUE),\
+         (const char **)((char *[]){ __VA_ARGS__ }),\
+         sizeof((char *[]){ __VA_ARGS__ })/sizeof(char *)))
+
 #define JSON_NUMBER(VALUE)\
     ((json_value_t) {\
      JSON_TYPE_NUMBER,\
@@ -89,7 +116,7 @@ typedef int64_t i64;
 #define JSON_NULL\
     ((json_value_t) {\
      JSON_TYPE_NULL,\
-     0,\
+     .number = 0,\
     })
 
 #define JSON_PROP(KEY, VALUE)\
@@ -111,6 +138,35 @@ typedef int64_t i64;
      },\
     })
 
+#define JSON_SNAPSHOT_GET(__VALUE, ...) \
+    (JSON_ASSERT((__VALUE).type == JSON_TYPE_OBJECT), \
+     __json_snapshot_object_get((__VALUE),\
+         (const char **)((char *[]){ __VA_ARGS__ }),\
+         sizeof((char *[]){ __VA_ARGS__ })/sizeof(char *)))
+
+#define JSON_SNAPSHOT_IGET(__VALUE, IDX) \
+    (JSON_ASSERT((__VALUE).type == JSON_TYPE_ARRAY), \
+     __json_snapshot_array_get((__VALUE), IDX))
+
+#define JSON_SNAPSHOT_ARRAY_LEN(__VALUE) \
+    (JSON_ASSERT((__VALUE).type == JSON_TYPE_ARRAY), \
+        (__VALUE).__node->len)
+
+#define JSON_SNAPSHOT_EXISTS(__VALUE, ...) \
+    (JSON_SNAPSHOT_GET(__VALUE, __VA_ARGS__).type != JSON_TYPE_NONE)
+
+#define JSON_SNAPSHOT_AS_NUMBER(__VALUE) \
+    (JSON_ASSERT((__VALUE).type == JSON_TYPE_NUMBER), \
+        (__VALUE).__node->number)
+
+#define JSON_SNAPSHOT_AS_BOOL(__VALUE) \
+    (JSON_ASSERT((__VALUE).type == JSON_TYPE_BOOL), \
+        (BOOL)(__VALUE).__node->boolean)
+
+#define JSON_SNAPSHOT_AS_STRING(__VALUE) \
+    (JSON_ASSERT((__VALUE).type == JSON_TYPE_STRING), \
+        (const char *)((__VALUE).__base + (__VALUE).__node->offset))
+
 typedef enum {
     TOKEN_STRING,
     TOKEN_NUMBER,
@@ -123,6 +179,7 @@ typedef enum {
     TOKEN_OBJECT_END,
     TOKEN_COMMA,
     TOKEN_COLUMN,
+    TOKEN_NONE,
 } __json_token_type_t;
 
 typedef enum {
@@ -179,8 +236,148 @@ typedef struct __json_property_t {
     struct __json_value_t value;
 } json_property_t;
 
+/*
+ * Snapshot layout, every offset is relative to the start of the header
+ * and every record is 8 byte aligned:
+ *
+ *   header | root node | payloads... | 8 zero bytes
+ *
+ * Arrays point to `len` contiguous nodes, objects to `len` contiguous
+ * properties, strings and keys to NUL terminated bytes. Records are in
+ * the writer's byte order, byte_order and double_size reject files from
+ * a machine that lays them out differently.
+ */
+typedef struct {
+    u32 magic;
+    u32 version;
+    u32 byte_order;
+    u32 double_size;
+    u64 size;
+    u64 checksum;
+    u64 root;
+} json_snapshot_header_t;
+
+typedef struct {
+    u32 type;
+    u32 len;
+    union {
+        double number;
+        u8 boolean;
+        u64 offset;
+    };
+} json_snapshot_node_t;
+
+typedef struct {
+    u64 key;
+    json_snapshot_node_t value;
+} json_snapshot_prop_t;
+
+typedef struct {
+    json_value_type_t type;
+    const u8 *__base;
+    u64 __size;
+    const json_snapshot_node_t *__node;
+} json_snapshot_value_t;
+
+typedef struct {
+    json_snapshot_value_t root;
+    u64 size;
+    const u8 *__data;
+    BOOL __owned;
+} json_snapshot_t;
+
+/*
+ * Source span of a document value, mirroring the tree: children[i] is
+ * the span of the i-th element or property value. The start is relative
+ * to the enclosing value's start.
+ */
+typedef struct __json_span_t {
+    u32 start;
+    u32 len;
+    u32 count;
+    struct __json_span_t *children;
+} __json_span_t;
+
+typedef struct {
+    json_value_t root;
+    char *text;
+    u32 len;
+    u32 __cap;
+    __json_span_t __span;
+} json_document_t;
+
+typedef void (*json_batch_callback_t)(void *user, const u32 idx,
+        const u32 err, json_value_t *value);
+
+typedef u32 (*json_sink_t)(void *user, const char *data, const u32 len);
+
+typedef struct {
+    u32 start;
+    u32 key_end;
+    u32 end;
+} __json_member_span_t;
+
+typedef struct {
+    u32 depth;
+    u32 first_member;
+} __json_sort_frame_t;
+
+typedef struct {
+    json_sink_t sink;
+    void *user;
+    u32 indent;
+    u32 err;
+
+    u32 depth;
+    BOOL in_string;
+    BOOL in_escape;
+    BOOL in_key;
+    BOOL expect_key;
+    BOOL pending_newline;
+
+    u32 __out_len;
+    char __out[JSON_TRANSCODE_BUF_SIZE];
+
+    // Key sorting window, objects that fit in it are emitted sorted
+    BOOL __buffering;
+    u32 __window_cap;
+    u32 __window_len;
+    char *__window;
+    char *__scratch;
+    u32 __members_cap;
+    u32 __members_len;
+    __json_member_span_t *__members;
+    u32 __frames_len;
+    __json_sort_frame_t __frames[JSON_TRANSCODE_MAX_DEPTH];
+} json_transcoder_t;
+
 u32 json_parse(json_value_t *value, const char *text, const u32 len);
 
+void json_free(json_value_t *value);
+
+u32 json_document_parse(json_document_t *document, const char *text,
+        const u32 len);
+
+u32 json_document_edit(json_document_t *document, const u32 start,
+        const u32 end, const char *text, const u32 len);
+
+void json_document_free(json_document_t *document);
+
+u32 json_batch_load(const char **paths, const u32 count, u32 threads,
+        json_batch_callback_t callback, void *user);
+
+u32 json_transcoder_init(json_transcoder_t *transcoder, const u32 indent,
+        const u32 sort_window, json_sink_t sink, void *user);
+
+u32 json_transcode(json_transcoder_t *transcoder, const char *chunk,
+        const u32 len);
+
+u32 json_transcode_finish(json_transcoder_t *transcoder);
+
+void json_transcoder_free(json_transcoder_t *transcoder);
+
+BOOL json_utf8_validate(const char *text, const u32 len);
+
 void * __json_object_get_raw(const json_object_t object,
         const char **keys, const u32 len);
 
@@ -190,8 +387,39 @@ json_value_type_t __json_value_type(const json_object_t value,
 void * __json_set(json_value_t *value, const char *key,
         const json_value_type_t type);
 
+void * __json_set_path(json_value_t *value, const char **keys,
+        const u32 len, const json_value_type_t type);
+
+BOOL __json_delete_path(json_value_t *value, const char **keys,
+        const u32 len);
+
 json_value_t __json_wrap_object_value(const json_value_t value);
 
+BOOL json_equal(const json_value_t *a, const json_value_t *b);
+
+u32 json_merge_patch(json_value_t *target, json_value_t *patch);
+
+u32 json_diff(const json_value_t *from, const json_value_t *to,
+        json_value_t *patch);
+
 void * __json_array_get_raw(const json_array_t array, const u32 idx);
 
+u32 json_snapshot_dump(const json_value_t *value, void **data, u64 *size);
+
+u32 json_snapshot_write(const json_value_t *value, const char *path);
+
+u32 json_snapshot_load(json_snapshot_t *snapshot, const void *data,
+        const u64 size, const BOOL verify);
+
+u32 json_snapshot_open(json_snapshot_t *snapshot, const char *path,
+        const BOOL verify);
+
+void json_snapshot_close(json_snapshot_t *snapshot);
+
+json_snapshot_value_t __json_snapshot_object_get(
+        const json_snapshot_value_t value, const char **keys, const u32 len);
+
+json_snapshot_value_t __json_snapshot_array_get(
+        const json_snapshot_value_t value, const u32 idx);
+
 #endif
@@ -0,0 +1,262 @@
+#ifndef JSON_HPP
+#define JSON_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+extern "C" {
+#include "json.h"
+}
+
+namespace jsonc {
+
+constexpr std::uint32_t fnv1a(const char *str, const std::size_t len) {
+    std::uint32_t hash = 2166136261u;
+    for (std::size_t i=0; i<len; i++) {
+        hash ^= static_cast<std::uint8_t>(str[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * A key with its length and hash computed at compile time when built
+ * from a literal. Lookups compare the length-bounded bytes directly, the
+ * hash only narrows a switch over literal keys down to one candidate
+ * that member::is() then confirms.
+ */
+struct key {
+    const char *data;
+    std::size_t size;
+    std::uint32_t hash;
+
+    constexpr key(const char *str, const std::size_t len)
+        : data(str), size(len), hash(fnv1a(str, len)) {}
+
+    template <std::size_t N>
+    constexpr key(const char (&str)[N]) : key(str, N - 1) {}
+
+    constexpr key(const std::string_view str) : key(str.data(), str.size()) {}
+
+    // Anything else viewable as a string, std::string or a const char *
+    template <typename S, typename = std::enable_if_t<!std::is_array_v<S>
+        && std::is_convertible_v<const S &, std::string_view>>>
+    key(const S &str) : key(std::string_view(str)) {}
+};
+
+namespace literals {
+
+constexpr key operator""_key(const char *str, const std::size_t len) {
+    return key(str, len);
+}
+
+}
+
+class view;
+
+struct member {
+    std::string_view key;
+    json_value_t *value;
+
+    std::uint32_t key_hash() const { return fnv1a(key.data(), key.size()); }
+    // Hashes can collide, a matching case still has to check the bytes
+    bool is(const jsonc::key &k) const {
+        return key.size() == k.size && !std::memcmp(key.data(), k.data, k.size);
+    }
+    inline view get() const;
+};
+
+// Non-owning handle over a value inside a tree
+class view {
+public:
+    view() : value_(nullptr) {}
+    explicit view(json_value_t *value) : value_(value) {}
+
+    json_value_type_t type() const {
+        return value_ != nullptr ? value_->type : JSON_TYPE_NONE;
+    }
+    explicit operator bool() const { return value_ != nullptr; }
+    json_value_t *raw() const { return value_; }
+
+    bool is_null() const { return type() == JSON_TYPE_NULL; }
+    bool is_object() const { return type() == JSON_TYPE_OBJECT; }
+    bool is_array() const { return type() == JSON_TYPE_ARRAY; }
+
+    double as_number() const {
+        JSON_ASSERT(type() == JSON_TYPE_NUMBER);
+        return value_->number;
+    }
+    bool as_bool() const {
+        JSON_ASSERT(type() == JSON_TYPE_BOOL);
+        return value_->boolean;
+    }
+    const char *as_cstr() const {
+        JSON_ASSERT(type() == JSON_TYPE_STRING);
+        return value_->str;
+    }
+    std::string_view as_string() const { return as_cstr(); }
+
+    // Same lookup as JSON_GET, T is the C type stored for the value
+    template <typename T, typename... Keys>
+    T &get(const Keys &... keys) const {
+        JSON_ASSERT(is_object());
+        view at = *this;
+        ((at = at[key(keys)]), ...);
+        JSON_ASSERT(at);
+        void *raw = at.value_;
+        switch (at.type()) {
+        case JSON_TYPE_BOOL: raw = &(at.value_->boolean); break;
+        case JSON_TYPE_STRING: raw = &(at.value_->str); break;
+        case JSON_TYPE_NUMBER: raw = &(at.value_->number); break;
+        default: break;
+        }
+        return *static_cast<T *>(raw);
+    }
+
+    view operator[](const key &k) const {
+        if (!is_object()) return view();
+        const json_object_t &object = value_->object;
+        for (u32 i=0; i<object.len; i++) {
+            // Lengths go first, a key holding a NUL can't read past name
+            const char *name = object.props[i].key;
+            if ((k.size == 0 || name[0] == k.data[0])
+                    && std::string_view(name) == std::string_view(k.data, k.size)) {
+                return view(&(object.props[i].value));
+            }
+        }
+        return view();
+    }
+
+    view operator[](const u32 idx) const {
+        if (!is_array() || idx >= value_->array.len) return view();
+        return view(&(value_->array.values[idx]));
+    }
+
+    u32 size() const {
+        if (is_array()) return value_->array.len;
+        if (is_object()) return value_->object.len;
+        return 0;
+    }
+
+    class array_iterator {
+    public:
+        explicit array_iterator(json_value_t *at) : at_(at) {}
+        view operator*() const { return view(at_); }
+        array_iterator &operator++() { ++at_; return *this; }
+        bool operator!=(const array_iterator &other) const {
+            return at_ != other.at_;
+        }
+    private:
+        json_value_t *at_;
+    };
+
+    class object_iterator {
+    public:
+        explicit object_iterator(json_property_t *at) : at_(at) {}
+        member operator*() const { return member{ at_->key, &(at_->value) }; }
+        object_iterator &operator++() { ++at_; return *this; }
+        bool operator!=(const object_iterator &other) const {
+            return at_ != other.at_;
+        }
+    private:
+        json_property_t *at_;
+    };
+
+    template <typename Iterator, typename Item>
+    struct range {
+        Item *first;
+        Item *last;
+        Iterator begin() const { return Iterator(first); }
+        Iterator end() const { return Iterator(last); }
+    };
+
+    range<array_iterator, json_value_t> items() const {
+        JSON_ASSERT(is_array());
+        json_value_t *values = value_->array.values;
+        return { values, values + value_->array.len };
+    }
+
+    range<object_iterator, json_property_t> members() const {
+        JSON_ASSERT(is_object());
+        json_property_t *props = value_->object.props;
+        return { props, props + value_->object.len };
+    }
+
+private:
+    json_value_t *value_;
+};
+
+inline view member::get() const { return view(value); }
+
+// Move-only owner of a tree, released with json_free
+class document {
+public:
+    document() : value_() { value_.type = JSON_TYPE_NULL; }
+    explicit document(const json_value_t value) : value_(value) {}
+    ~document() { json_free(&value_); }
+
+    document(const document &) = delete;
+    document &operator=(const document &) = delete;
+
+    document(document &&other) noexcept : value_(other.value_) {
+        other.value_.type = JSON_TYPE_NULL;
+    }
+    document &operator=(document &&other) noexcept {
+        if (this != &other) {
+            json_free(&value_);
+            value_ = other.value_;
+            other.value_.type = JSON_TYPE_NULL;
+        }
+        return *this;
+    }
+
+    // Like json_parse, the text must be followed by a NUL
+    static u32 parse(document &doc, const char *text) {
+        return parse_terminated(doc, text, std::strlen(text));
+    }
+    static u32 parse(document &doc, const std::string &text) {
+        return parse_terminated(doc, text.c_str(), text.size());
+    }
+    // A view has no NUL after it, so it's parsed from a copy
+    static u32 parse(document &doc, const std::string_view text) {
+        return parse(doc, std::string(text));
+    }
+
+    view root() { return view(&value_); }
+    view operator[](const key &k) { return root()[k]; }
+    view operator[](const u32 idx) { return root()[idx]; }
+
+    u32 merge_patch(document &&patch) {
+        return json_merge_patch(&value_, &(patch.value_));
+    }
+
+    json_value_t *raw() { return &value_; }
+
+    json_value_t release() {
+        json_value_t value = value_;
+        value_.type = JSON_TYPE_NULL;
+        return value;
+    }
+
+private:
+    static u32 parse_terminated(document &doc, const char *text,
+            const std::size_t len) {
+        json_value_t value;
+        const u32 err = json_parse(&value, text, static_cast<u32>(len));
+        if (err == NONE) {
+            doc = document(value);
+        }
+        return err;
+    }
+
+    json_value_t value_;
+};
+
+}
+
+#endif
@@ -1,9 +1,66 @@
 #include <stdio.h>
 #include <assert.h>
 #include <string.h>
+#include <stdlib.h>
 
 #include "../json.h"
 
+typedef struct {
+    char data[1024];
+    u32 len;
+} string_sink_t;
+
+static u32 string_sink(void *user, const char *data, const u32 len) {
+    string_sink_t *sink = (string_sink_t *)user;
+    if (sink->len + len >= sizeof(sink->data)) return 1;
+    memcpy(&(sink->data[sink->len]), data, len);
+    sink->len += len;
+    sink->data[sink->len] = 0;
+    return 0;
+}
+
+static const char *transcode(const char *text, const u32 chunk_len,
+        const u32 indent, const u32 sort_window, string_sink_t *sink) {
+    json_transcoder_t transcoder;
+    sink->len = 0;
+    sink->data[0] = 0;
+    assert(json_transcoder_init(&transcoder, indent, sort_window,
+                string_sink, sink) == NONE);
+    const u32 len = strlen(text);
+    for (u32 i=0; i<len; i+=chunk_len) {
+        const u32 n = len - i < chunk_len ? len - i : chunk_len;
+        assert(json_transcode(&transcoder, &(text[i]), n) == NONE);
+    }
+    assert(json_transcode_finish(&transcoder) == NONE);
+    json_transcoder_free(&transcoder);
+    return sink->data;
+}
+
+static BOOL spans_equal(const __json_span_t *a, const __json_span_t *b) {
+    if (a->start != b->start || a->len != b->len || a->count != b->count) {
+        return FALSE;
+    }
+    for (u32 i=0; i<a->count; i++) {
+        if (!spans_equal(&(a->children[i]), &(b->children[i]))) return FALSE;
+    }
+    return TRUE;
+}
+
+typedef struct {
+    u32 err;
+    double id;
+} batch_result_t;
+
+static void batch_collect(void *user, const u32 idx, const u32 err,
+        json_value_t *value) {
+    batch_result_t *results = (batch_result_t *)user;
+    results[idx].err = err;
+    if (value != NULL) {
+        results[idx].id = JSON_GET((*value), double, "id");
+        json_free(value);
+    }
+}
+
 i32 main(void) {
     const char *json_string = \
         "{ \"ciao\": 1234.1234,\
@@ -74,5 +131,275 @@ i32 main(void) {
         printf("Found number: %f\n", number);
     }
  
+    const char *escaped_string = \
+        "{ \"plain\": \"a fairly long string without any escapes in it\",\
+           \"escapes\": \"tab\\there \\\"quoted\\\" back\\\\slash\\n\",\
+           \"unicode\": \"caf\\u00e9 \\u20ac \\ud83d\\ude00 na\xc3\xafve\"\
+        }";
+    json_value_t escaped;
+    json_parse(&escaped, escaped_string, strlen(escaped_string));
+    assert(!strcmp(JSON_GET(escaped, const char *, "plain"),
+                "a fairly long string without any escapes in it"));
+    assert(!strcmp(JSON_GET(escaped, const char *, "escapes"),
+                "tab\there \"quoted\" back\\slash\n"));
+    assert(!strcmp(JSON_GET(escaped, const char *, "unicode"),
+                "caf\xc3\xa9 \xe2\x82\xac \xf0\x9f\x98\x80 na\xc3\xafve"));
+    printf("Decoded unicode: %s\n", JSON_GET(escaped, const char *, "unicode"));
+
+    assert(json_utf8_validate("plain ascii text, long enough for a block", 41));
+    assert(json_utf8_validate("na\xc3\xafve \xf0\x9f\x98\x80", 11));
+    assert(!json_utf8_validate("\xc0\xaf", 2));
+    assert(!json_utf8_validate("\xed\xa0\x80", 3));
+    assert(!json_utf8_validate("0123456789abcdef\xe2\x82", 18));
+    // Sequences crossing a 16 byte block boundary
+    assert(json_utf8_validate("0123456789abcde\xe2\x82\xac" "0123456789", 28));
+    assert(!json_utf8_validate("0123456789abcde\xe2\x82" "A123456789", 27));
+    assert(!json_utf8_validate("0123456789abcdef\xf4\x90\x80\x80", 20));
+
+    const char *malformed[] = {
+        "{\"a\": }", "{\"a\" 1}", "[1, 2", "[1 2]", "{\"a\": nul}",
+        "{\"a\": \"\\q\"}", "{\"a\": \"\\ud800\"}", "{\"a\": \"\xc0\xaf\"}",
+        "{\"a\": \"open}", "[1] 2", "{\"a\": -}", "[\"x\", @]",
+        "{\"a\": \"raw\ttab\"}", "[\"a long string with a raw\nnewline\"]",
+        "[1-2]", "{\"a\": 1.5-3}",
+    };
+    for (u32 i=0; i<sizeof(malformed) / sizeof(malformed[0]); i++) {
+        json_value_t rejected;
+        assert(json_parse(&rejected, malformed[i], strlen(malformed[i]))
+                == JSON_PARSE_ERR);
+        json_free(&rejected);
+    }
+
+    const char *pretty = \
+        "{\n  \"zeta\" : [ 1, 2.5 , true,\tnull ],\r\n"
+        "  \"alpha\": { \"y\": \"a \\\" }\", \"x\": {} },\n"
+        "  \"mid\":   \"  spaced  out  \"\n}\n";
+    string_sink_t sink;
+    assert(!strcmp(transcode(pretty, 4096, 0, 0, &sink),
+                "{\"zeta\":[1,2.5,true,null],"
+                "\"alpha\":{\"y\":\"a \\\" }\",\"x\":{}},"
+                "\"mid\":\"  spaced  out  \"}"));
+    assert(!strcmp(transcode(pretty, 3, 0, 0, &sink),
+                "{\"zeta\":[1,2.5,true,null],"
+                "\"alpha\":{\"y\":\"a \\\" }\",\"x\":{}},"
+                "\"mid\":\"  spaced  out  \"}"));
+    assert(!strcmp(transcode(pretty, 5, 2, 256, &sink),
+                "{\n"
+                "  \"alpha\": {\n"
+                "    \"x\": {},\n"
+                "    \"y\": \"a \\\" }\"\n"
+                "  },\n"
+                "  \"mid\": \"  spaced  out  \",\n"
+                "  \"zeta\": [\n"
+                "    1,\n"
+                "    2.5,\n"
+                "    true,\n"
+                "    null\n"
+                "  ]\n"
+                "}"));
+    // Only the inner object fits in the window, the outer keeps its order
+    assert(!strcmp(transcode(pretty, 7, 0, 24, &sink),
+                "{\"zeta\":[1,2.5,true,null],"
+                "\"alpha\":{\"x\":{},\"y\":\"a \\\" }\"},"
+                "\"mid\":\"  spaced  out  \"}"));
+    // Long enough for the block path, escapes cut blocks short
+    const char *blocks = \
+        "{\n    \"long key with spaces\" :   \"value \\\"quoted\\\" "
+        "and \\\\ slash\",\n    \"list\": [ 1,   2,   3 ]\n}\n";
+    assert(!strcmp(transcode(blocks, 4096, 0, 0, &sink),
+                "{\"long key with spaces\":\"value \\\"quoted\\\" "
+                "and \\\\ slash\",\"list\":[1,2,3]}"));
+    assert(!strcmp(transcode(blocks, 19, 0, 0, &sink),
+                "{\"long key with spaces\":\"value \\\"quoted\\\" "
+                "and \\\\ slash\",\"list\":[1,2,3]}"));
+    printf("Minified: %s\n", transcode(pretty, 4096, 0, 4096, &sink));
+
+    const char *snapshot_path = "test_snapshot.bin";
+    assert(json_snapshot_write(&value, snapshot_path) == NONE);
+    json_snapshot_t snapshot;
+    assert(json_snapshot_open(&snapshot, snapshot_path, TRUE) == NONE);
+    json_snapshot_value_t root = snapshot.root;
+    assert(JSON_SNAPSHOT_AS_NUMBER(JSON_SNAPSHOT_GET(root, "ciao")) == 1234.1234);
+    assert(!strcmp(JSON_SNAPSHOT_AS_STRING(JSON_SNAPSHOT_GET(root, "name")),
+                "roberto"));
+    assert(JSON_SNAPSHOT_AS_BOOL(JSON_SNAPSHOT_GET(root, "truthy")));
+    assert(JSON_SNAPSHOT_GET(root, "nully").type == JSON_TYPE_NULL);
+    assert(!JSON_SNAPSHOT_EXISTS(root, "missing"));
+    json_snapshot_value_t stuff = JSON_SNAPSHOT_GET(root, "stuff_here");
+    assert(JSON_SNAPSHOT_ARRAY_LEN(stuff) == 5 + 1);
+    assert(JSON_SNAPSHOT_AS_NUMBER(JSON_SNAPSHOT_IGET(stuff, 4)) == 5.0);
+    json_snapshot_value_t more = JSON_SNAPSHOT_IGET(stuff, 5);
+    assert(JSON_SNAPSHOT_AS_NUMBER(JSON_SNAPSHOT_GET(more, "more")) == 12.0);
+    printf("Snapshot name: %s\n",
+            JSON_SNAPSHOT_AS_STRING(JSON_SNAPSHOT_GET(root, "name")));
+    json_snapshot_close(&snapshot);
+    remove(snapshot_path);
+
+    void *dump;
+    u64 dump_size;
+    assert(json_snapshot_dump(&o, &dump, &dump_size) == NONE);
+    assert(json_snapshot_load(&snapshot, dump, dump_size, TRUE) == NONE);
+    assert(!strcmp(JSON_SNAPSHOT_AS_STRING(JSON_SNAPSHOT_GET(snapshot.root,
+                        "value", "test_object", "nested")),
+                "Some deeply nested string"));
+    // Without verify a corrupt offset makes the lookup miss
+    json_snapshot_header_t *dump_header = (json_snapshot_header_t *)dump;
+    json_snapshot_node_t *dump_root =
+        (json_snapshot_node_t *)&(((u8 *)dump)[dump_header->root]);
+    json_snapshot_prop_t *dump_props =
+        (json_snapshot_prop_t *)&(((u8 *)dump)[dump_root->offset]);
+    dump_props[1].value.offset = dump_size - 8;
+    assert(json_snapshot_load(&snapshot, dump, dump_size, FALSE) == NONE);
+    assert(JSON_SNAPSHOT_GET(snapshot.root, "value").type == JSON_TYPE_NONE);
+    assert(!JSON_SNAPSHOT_EXISTS(snapshot.root, "value", "test_object"));
+    assert(JSON_SNAPSHOT_AS_NUMBER(JSON_SNAPSHOT_GET(snapshot.root, "test"))
+            == 9999.0);
+    dump_header->byte_order = 0x04030201;
+    assert(json_snapshot_load(&snapshot, dump, dump_size, FALSE) == JSON_SNAPSHOT_ERR);
+    dump_header->byte_order = JSON_SNAPSHOT_BYTE_ORDER;
+    ((u8 *)dump)[dump_size - 1] ^= 1;
+    assert(json_snapshot_load(&snapshot, dump, dump_size, TRUE) == JSON_SNAPSHOT_ERR);
+    free(dump);
+
+    const char *config = "{ \"name\": \"svc\", \"limits\": { \"cpu\": 2, \"mem\": 512 },"
+        " \"tags\": [\"a\", \"b\"], \"list\": [], \"extra\": {} }";
+    json_document_t document;
+    assert(json_document_parse(&document, config, strlen(config)) == NONE);
+    const char *name_before = JSON_GET(document.root, const char *, "name");
+
+    // "2" -> "16", only the number is re-parsed
+    const u32 cpu = strstr(document.text, "2,") - document.text;
+    assert(json_document_edit(&document, cpu, cpu + 1, "16", 2) == NONE);
+    assert(JSON_GET(document.root, double, "limits", "cpu") == 16.0);
+    assert(JSON_GET(document.root, double, "limits", "mem") == 512.0);
+    assert(JSON_GET(document.root, const char *, "name") == name_before);
+
+    // Adding a member re-parses the enclosing object
+    const u32 mem = strstr(document.text, "512") - document.text;
+    assert(json_document_edit(&document, mem + 3, mem + 3,
+                ", \"io\": true", 12) == NONE);
+    assert(JSON_GET(document.root, u8, "limits", "io") == TRUE);
+    assert(JSON_GET(document.root, const char *, "name") == name_before);
+
+    // Spans after the edits were shifted
+    const u32 tag = strstr(document.text, "\"b\"") - document.text;
+    assert(json_document_edit(&document, tag + 1, tag + 2, "bee", 3) == NONE);
+    json_value_t tags = JSON_GET(document.root, json_value_t, "tags");
+    assert(!strcmp(JSON_IGET(tags, const char *, 1), "bee"));
+    assert(JSON_GET(document.root, const char *, "name") == name_before);
+
+    // Empty containers are re-parsed like any other value
+    const u32 list = strstr(document.text, "[]") - document.text;
+    assert(json_document_edit(&document, list + 1, list + 1, "7", 1) == NONE);
+    json_value_t list_value = JSON_GET(document.root, json_value_t, "list");
+    assert(JSON_ARRAY_LEN(list_value) == 1);
+    assert(JSON_IGET(list_value, double, 0) == 7.0);
+    const u32 extra = strstr(document.text, "{}") - document.text;
+    assert(json_document_edit(&document, extra + 1, extra + 1,
+                "\"k\": 1", 6) == NONE);
+    assert(JSON_GET(document.root, double, "extra", "k") == 1.0);
+    assert(JSON_GET(document.root, const char *, "name") == name_before);
+
+    // Rejected edits leave the text and the tree as they were
+    char before[256];
+    memcpy(before, document.text, document.len + 1);
+    const u32 cpu_now = strstr(document.text, "16") - document.text;
+    assert(json_document_edit(&document, cpu_now, cpu_now + 2, "1 2", 3)
+            == JSON_PARSE_ERR);
+    const u32 bee = strstr(document.text, "bee") - document.text;
+    assert(json_document_edit(&document, bee, bee + 3, "q\"y", 3)
+            == JSON_PARSE_ERR);
+    assert(!strcmp(document.text, before));
+    assert(JSON_GET(document.root, double, "limits", "cpu") == 16.0);
+    assert(JSON_GET(document.root, const char *, "name") == name_before);
+    assert(json_document_edit(&document, list + 2, list + 2, "0", 1) == NONE);
+    assert(JSON_IGET(JSON_GET(document.root, json_value_t, "list"),
+                double, 0) == 70.0);
+
+    // Spans kept up to date by the edits match a fresh parse
+    json_document_t fresh;
+    assert(json_document_parse(&fresh, document.text, document.len) == NONE);
+    assert(spans_equal(&(fresh.__span), &(document.__span)));
+    assert(json_equal(&(fresh.root), &(document.root)));
+    printf("Edited document: %s\n", document.text);
+    json_document_free(&fresh);
+    json_document_free(&document);
+
+    char batch_names[40][32];
+    const char *batch_paths[40];
+    for (u32 i=0; i<40; i++) {
+        sprintf(batch_names[i], "test_batch_%u.json", i);
+        batch_paths[i] = batch_names[i];
+        if (i == 7) continue; // missing file
+        FILE *file = fopen(batch_names[i], "w");
+        if (i == 9) fprintf(file, "{\"a\": }"); // malformed
+        else if (i != 8) fprintf(file, "{ \"id\": %u, \"pad\": [1, 2, 3] }", i);
+        fclose(file);
+    }
+    batch_result_t results[40] = {0};
+    assert(json_batch_load(batch_paths, 40, 3, batch_collect, results) == NONE);
+    for (u32 i=0; i<40; i++) {
+        if (i == 7) {
+            assert(results[i].err == JSON_FOPEN_ERR);
+        } else if (i == 8) {
+            assert(results[i].err == JSON_LEN_MISMATCH_ERR);
+        } else if (i == 9) {
+            assert(results[i].err == JSON_PARSE_ERR);
+        } else {
+            assert(results[i].err == NONE && results[i].id == (double)i);
+        }
+        remove(batch_names[i]);
+    }
+    printf("Batch loaded: %u files\n", 40 - 3);
+
+    const char *target_text = "{ \"title\": \"Goodbye!\", \"author\": {"
+        " \"givenName\": \"John\", \"familyName\": \"Doe\" },"
+        " \"tags\": [\"example\", \"sample\"], \"content\": \"This will be unchanged\" }";
+    const char *patch_text = "{ \"title\": \"Hello!\", \"phoneNumber\": \"+01-123-456-7890\","
+        " \"author\": { \"familyName\": null }, \"tags\": [\"example\"],"
+        " \"extra\": { \"drop\": null, \"keep\": 1 } }";
+    const char *result_text = "{ \"title\": \"Hello!\", \"author\": { \"givenName\": \"John\" },"
+        " \"tags\": [\"example\"], \"content\": \"This will be unchanged\","
+        " \"phoneNumber\": \"+01-123-456-7890\", \"extra\": { \"keep\": 1 } }";
+    json_value_t target, patch, expected;
+    json_parse(&target, target_text, strlen(target_text));
+    json_parse(&patch, patch_text, strlen(patch_text));
+    json_parse(&expected, result_text, strlen(result_text));
+
+    json_value_t original;
+    json_parse(&original, target_text, strlen(target_text));
+    const char *content = JSON_GET(target, const char *, "content");
+    assert(json_merge_patch(&target, &patch) == NONE);
+    assert(patch.type == JSON_TYPE_NULL);
+    assert(json_equal(&target, &expected));
+    assert(JSON_GET(target, const char *, "content") == content);
+
+    json_value_t diff;
+    assert(json_diff(&original, &expected, &diff) == NONE);
+    assert(!JSON_EXISTS(diff, "content"));
+    assert(json_merge_patch(&original, &diff) == NONE);
+    assert(json_equal(&original, &expected));
+
+    const char *duplicate_text = "{ \"\": 1, \"\": [], \"k\": { \"x\": 1, \"x\": 2 } }";
+    json_value_t duplicate, duplicate_copy, duplicate_diff;
+    assert(json_parse(&duplicate, duplicate_text, strlen(duplicate_text)) == NONE);
+    assert(json_parse(&duplicate_copy, duplicate_text, strlen(duplicate_text)) == NONE);
+    assert(json_equal(&duplicate, &duplicate_copy));
+    assert(json_diff(&duplicate, &duplicate_copy, &duplicate_diff) == NONE);
+    assert(duplicate_diff.object.len == 0);
+    json_free(&duplicate);
+    json_free(&duplicate_copy);
+    json_free(&duplicate_diff);
+
+    JSON_SET_IN(target, JSON_TYPE_NUMBER, double, 3.0, "author", "address", "floor");
+    assert(JSON_GET(target, double, "author", "address", "floor") == 3.0);
+    assert(JSON_DELETE(target, "author", "givenName"));
+    assert(!JSON_DELETE(target, "author", "givenName"));
+    assert(!JSON_EXISTS(target, "author", "givenName"));
+    assert(JSON_EXISTS(target, "author", "address"));
+    json_free(&target);
+    json_free(&original);
+    json_free(&expected);
+ 
     return 0;
 }
@@ -0,0 +1,94 @@
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "../json.hpp"
+
+using namespace jsonc::literals;
+
+i32 main(void) {
+    const char *json_string = \
+        "{ \"ciao\": 1234.1234,\
+           \"name\": \"roberto\",\
+           \"truthy\": true,\
+           \"nested\": { \"inner\": { \"deep\": 7 } },\
+           \"glbpp\": 1,\
+           \"stuff_here\": [1, 2, 3, 4, 5]\
+        }";
+
+    jsonc::document doc;
+    assert(jsonc::document::parse(doc, json_string) == NONE);
+
+    assert(doc["ciao"].as_number() == 1234.1234);
+    assert(doc["name"].as_string() == "roberto");
+    assert(doc["truthy"].as_bool());
+    assert(!doc["missing"]);
+    assert(!doc["nam"]);
+    assert(doc["nested"]["inner"]["deep"].as_number() == 7.0);
+    assert(doc.root().get<double>("nested", "inner", "deep") == 7.0);
+
+    const std::string_view name_view = std::string_view("names").substr(0, 4);
+    const std::string nested_name = "nested";
+    assert(doc[name_view].as_string() == "roberto");
+    assert(!doc[std::string_view("nam")]);
+    assert(!doc[std::string_view("name\0 and bytes past it", 23)]);
+    assert(doc[nested_name]["inner"]["deep"].as_number() == 7.0);
+    assert(doc.root().get<const char *>(name_view) == doc["name"].as_cstr());
+    assert(doc.root().get<double>(nested_name, std::string("inner"), "deep") == 7.0);
+
+    double sum = 0.0;
+    for (jsonc::view item : doc["stuff_here"].items()) {
+        sum += item.as_number();
+    }
+    assert(sum == 15.0);
+
+    constexpr jsonc::key name_key = "name"_key;
+    static_assert(name_key.size == 4, "key length is known at compile time");
+    // "yaczf" and "glbpp" share an FNV-1a hash, only the bytes tell them apart
+    constexpr jsonc::key colliding_key = "yaczf"_key;
+    static_assert(colliding_key.hash == jsonc::key("glbpp").hash, "FNV-1a collision");
+    u32 seen = 0;
+    for (jsonc::member m : doc.root().members()) {
+        switch (m.key_hash()) {
+        case name_key.hash:
+            if (!m.is(name_key)) break;
+            assert(m.get().as_string() == "roberto");
+            seen++;
+            break;
+        case jsonc::key("truthy").hash:
+            if (!m.is("truthy")) break;
+            seen++;
+            break;
+        case colliding_key.hash:
+            assert(m.is("glbpp") && !m.is(colliding_key));
+            break;
+        default:
+            break;
+        }
+    }
+    assert(seen == 2);
+
+    // Only the view is parsed, not the byte after it
+    const char *overlong = "[1]]";
+    jsonc::document bounded;
+    assert(jsonc::document::parse(bounded, std::string_view(overlong, 3)) == NONE);
+    assert(bounded.root().size() == 1 && bounded[0].as_number() == 1.0);
+    assert(jsonc::document::parse(bounded, std::string("{ \"s\": 2 }")) == NONE);
+    assert(bounded["s"].as_number() == 2.0);
+
+    jsonc::document moved = std::move(doc);
+    assert(doc.root().is_null());
+    assert(moved["name"].as_string() == "roberto");
+
+    jsonc::document patch;
+    assert(jsonc::document::parse(patch, "{ \"name\": \"bob\", \"ciao\": null }") == NONE);
+    assert(moved.merge_patch(std::move(patch)) == NONE);
+    assert(moved["name"].as_string() == "bob");
+    assert(!moved["ciao"]);
+
+    printf("C++ name: %s\n", moved["name"].as_cstr());
+    return 0;
+}